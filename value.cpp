@@ -1,26 +1,667 @@
 #include <iostream>
+#include <fstream>
 #include <vector>
+#include <array>
+#include <tuple>
+#include <utility>
 #include <memory>
 #include <functional>
+#include <type_traits>
 #include <string>
 #include <set>
 #include <cassert>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <future>
+#include <unordered_map>
+#include <random>
+#include <cmath>
+#include <algorithm>
+#include <new>
+#include <sched.h>
+#include <pthread.h>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cctype>
+#include <charconv>
+#include <limits>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// chase-lev work-stealing deque (le et al., "correct and efficient
+// work-stealing for weak memory models"): the owner pushes and pops at the
+// bottom without locks, thieves take from the top with a single cas
+template <typename T>
+class WorkStealingDeque {
+public:
+    explicit WorkStealingDeque(int64_t capacity = 256) : top(0), bottom(0) {
+        arrays.push_back(std::make_unique<Array>(capacity));
+        array.store(arrays.back().get(), std::memory_order_relaxed);
+    }
+
+    // owner only
+    void push(T* x) {
+        int64_t b = bottom.load(std::memory_order_relaxed);
+        int64_t t = top.load(std::memory_order_acquire);
+        Array* a = array.load(std::memory_order_relaxed);
+        if (b - t > a->capacity - 1) {
+            a = grow(a, t, b);
+        }
+        a->put(b, x);
+        bottom.store(b + 1, std::memory_order_release);
+    }
+
+    // owner only
+    T* pop() {
+        int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        Array* a = array.load(std::memory_order_relaxed);
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top.load(std::memory_order_relaxed);
+        T* x = nullptr;
+        if (t <= b) {
+            x = a->get(b);
+            if (t == b) {
+                // last element, race the thieves for it
+                if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                    x = nullptr;
+                }
+                bottom.store(b + 1, std::memory_order_relaxed);
+            }
+        } else {
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return x;
+    }
+
+    // any thread
+    T* steal() {
+        int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom.load(std::memory_order_acquire);
+        if (t >= b) return nullptr;
+        Array* a = array.load(std::memory_order_acquire);
+        T* x = a->get(t);
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return nullptr;
+        }
+        return x;
+    }
+
+    bool empty() const {
+        return bottom.load(std::memory_order_relaxed) <= top.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Array {
+        int64_t capacity;
+        std::unique_ptr<std::atomic<T*>[]> slots;
+
+        explicit Array(int64_t capacity) : capacity(capacity), slots(new std::atomic<T*>[capacity]) {}
+
+        T* get(int64_t i) const {
+            return slots[i & (capacity - 1)].load(std::memory_order_relaxed);
+        }
+
+        void put(int64_t i, T* x) {
+            slots[i & (capacity - 1)].store(x, std::memory_order_relaxed);
+        }
+    };
+
+    Array* grow(Array* a, int64_t t, int64_t b) {
+        // thieves may still read the old array, so it is retired rather than freed
+        auto bigger = std::make_unique<Array>(a->capacity * 2);
+        for (int64_t i = t; i < b; ++i) {
+            bigger->put(i, a->get(i));
+        }
+        Array* raw = bigger.get();
+        arrays.push_back(std::move(bigger));
+        array.store(raw, std::memory_order_release);
+        return raw;
+    }
+
+    alignas(64) std::atomic<int64_t> top;
+    alignas(64) std::atomic<int64_t> bottom;
+    std::atomic<Array*> array;
+    std::vector<std::unique_ptr<Array>> arrays;
+};
+
+// cpus this process may run on (respects taskset / cgroup cpusets)
+inline std::vector<int> allowed_cpus() {
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int c = 0; c < CPU_SETSIZE; ++c) {
+            if (CPU_ISSET(c, &set)) cpus.push_back(c);
+        }
+    }
+    if (cpus.empty()) cpus.push_back(0);
+    return cpus;
+}
+
+// the one thread pool every parallel path runs on. each worker owns a
+// chase-lev deque and pops its own tasks lifo; idle workers steal fifo from
+// the others and from a shared queue for tasks submitted by outside threads.
+// a worker that runs dry spins briefly before parking, so back-to-back
+// parallel regions do not pay a futex wake-up each time
+struct ThreadPoolOptions {
+    int threads = 0;        // 0: one per allowed cpu, minus the calling thread
+    bool pin = false;       // pin worker i to the i-th allowed cpu
+    int spin = 2000;        // idle polls before a worker parks
+};
+
+class ThreadPool {
+public:
+    using Options = ThreadPoolOptions;
+
+    explicit ThreadPool(int nthreads) : ThreadPool(Options{nthreads, false, 2000}) {}
+
+    explicit ThreadPool(Options options = Options()) : opts(options), stop(false), pending(0), sleeping(0) {
+        auto cpus = allowed_cpus();
+        int n = opts.threads > 0 ? opts.threads : std::max(1, (int)cpus.size() - 1);
+        for (int i = 0; i < n; ++i) {
+            queues.push_back(std::make_unique<WorkStealingDeque<Task>>());
+        }
+        for (int i = 0; i < n; ++i) {
+            threads.emplace_back([this, i]() { worker_loop(i); });
+            if (opts.pin) {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(cpus[i % cpus.size()], &set);
+                pthread_setaffinity_np(threads.back().native_handle(), sizeof(set), &set);
+            }
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(idle_m);
+            stop.store(true);
+        }
+        idle_cv.notify_all();
+        for (auto& t : threads) {
+            t.join();
+        }
+        // tasks nobody picked up before shutdown are dropped, not run
+        for (Task* t : injected) {
+            delete t;
+        }
+        for (auto& q : queues) {
+            while (Task* t = q->steal()) {
+                delete t;
+            }
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const {
+        return (int)threads.size();
+    }
+
+    // tasks submitted from a worker go to its own deque, everything else to the shared queue
+    void submit(std::function<void()> task) {
+        Task* t = new Task(std::move(task));
+        if (tl_pool == this) {
+            queues[tl_index]->push(t);
+        } else {
+            std::lock_guard<std::mutex> lock(inject_m);
+            injected.push_back(t);
+        }
+        pending.fetch_add(1, std::memory_order_seq_cst);
+        if (sleeping.load(std::memory_order_seq_cst) > 0) {
+            {
+                std::lock_guard<std::mutex> lock(idle_m);
+            }
+            idle_cv.notify_one();
+        }
+    }
+
+    // run pool tasks on the calling thread until done() holds, so a waiting
+    // caller (or a nested parallel region on a worker) never blocks a core
+    template <typename Pred>
+    void help_until(Pred done) {
+        while (!done()) {
+            if (!try_run_one()) {
+                cpu_relax();
+            }
+        }
+    }
+
+    // run fn(i) for i in [0, n). indices are handed out in chunks of grain
+    // (0 picks about four chunks per thread) from a shared counter, and only
+    // as many helper tasks are spawned as there are chunks to share. if fn
+    // throws, the remaining chunks are skipped and the first exception is
+    // rethrown here once every helper has finished
+    void parallel_for(int n, const std::function<void(int)>& fn, int grain = 0) {
+        if (n <= 0) return;
+        if (grain <= 0) grain = std::max(1, n / (4 * (size() + 1)));
+        int chunks = (n + grain - 1) / grain;
+        if (chunks == 1) {
+            for (int i = 0; i < n; ++i) fn(i);
+            return;
+        }
+        std::atomic<int> next_chunk(0);
+        std::atomic<int> exited(0);
+        std::mutex error_m;
+        std::exception_ptr error;
+        auto work = [&]() {
+            try {
+                for (int c = next_chunk.fetch_add(1, std::memory_order_relaxed); c < chunks; c = next_chunk.fetch_add(1, std::memory_order_relaxed)) {
+                    for (int i = c * grain; i < std::min(n, (c + 1) * grain); ++i) fn(i);
+                }
+            } catch (...) {
+                next_chunk.store(chunks, std::memory_order_relaxed);
+                std::lock_guard<std::mutex> lock(error_m);
+                if (!error) error = std::current_exception();
+            }
+        };
+        int helpers = std::min(chunks - 1, size());
+        for (int h = 0; h < helpers; ++h) {
+            submit([&]() {
+                work();
+                exited.fetch_add(1, std::memory_order_release);
+            });
+        }
+        work();
+        // helpers reference this frame, so wait for every one of them, not just the chunks
+        help_until([&]() { return exited.load(std::memory_order_acquire) == helpers; });
+        if (error) std::rethrow_exception(error);
+    }
+
+    static ThreadPool& global() {
+        static ThreadPool pool;
+        return pool;
+    }
+
+private:
+    using Task = std::function<void()>;
+
+    Options opts;
+    std::vector<std::unique_ptr<WorkStealingDeque<Task>>> queues;
+    std::vector<std::thread> threads;
+    std::mutex inject_m;
+    std::deque<Task*> injected;
+    std::atomic<bool> stop;
+    std::mutex idle_m;
+    std::condition_variable idle_cv;
+    std::atomic<int> pending;
+    std::atomic<int> sleeping;
+
+    static thread_local ThreadPool* tl_pool;
+    static thread_local int tl_index;
+
+    static void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        asm volatile("yield");
+#else
+        std::this_thread::yield();
+#endif
+    }
+
+    Task* take() {
+        int self = (tl_pool == this) ? tl_index : -1;
+        if (self >= 0) {
+            if (Task* t = queues[self]->pop()) return t;
+        }
+        if (pending.load(std::memory_order_relaxed) <= 0) return nullptr;
+        {
+            std::lock_guard<std::mutex> lock(inject_m);
+            if (!injected.empty()) {
+                Task* t = injected.front();
+                injected.pop_front();
+                return t;
+            }
+        }
+        int n = (int)queues.size();
+        int start = self >= 0 ? self + 1 : 0;
+        for (int k = 0; k < n; ++k) {
+            int victim = (start + k) % n;
+            if (victim == self) continue;
+            if (Task* t = queues[victim]->steal()) return t;
+        }
+        return nullptr;
+    }
+
+    bool try_run_one() {
+        Task* t = take();
+        if (!t) return false;
+        pending.fetch_sub(1, std::memory_order_relaxed);
+        (*t)();
+        delete t;
+        return true;
+    }
+
+    void worker_loop(int i) {
+        tl_pool = this;
+        tl_index = i;
+        int idle = 0;
+        while (!stop.load(std::memory_order_relaxed)) {
+            if (try_run_one()) {
+                idle = 0;
+                continue;
+            }
+            if (++idle < opts.spin) {
+                cpu_relax();
+                continue;
+            }
+            // park; the seq_cst pair sleeping++ / pending check matches submit's
+            // pending++ / sleeping check, so a wake-up cannot be lost
+            std::unique_lock<std::mutex> lock(idle_m);
+            sleeping.fetch_add(1, std::memory_order_seq_cst);
+            idle_cv.wait(lock, [this]() { return stop.load() || pending.load(std::memory_order_seq_cst) > 0; });
+            sleeping.fetch_sub(1, std::memory_order_seq_cst);
+            idle = 0;
+        }
+    }
+};
+
+thread_local ThreadPool* ThreadPool::tl_pool = nullptr;
+thread_local int ThreadPool::tl_index = -1;
+
+// per-thread free lists of small fixed-size blocks carved from 64KB slabs.
+// graph nodes built on a worker come from that worker's own slabs without
+// touching the shared heap. every slab records the heap that carved it, and a
+// block freed on another thread goes back to that heap through a lock-free
+// remote list, drained on its next refill; so graphs built on pool workers and
+// torn down on the caller recycle instead of growing both sides. the heap of
+// an exiting thread, remote list included, is adopted by the next new thread
+class NodeArena {
+public:
+    static constexpr size_t kAlign = 16;
+    static constexpr size_t kClasses = 16;
+    static constexpr size_t kSlab = 64 << 10;
+
+    static void* allocate(size_t bytes) {
+        size_t k = (bytes + kAlign - 1) / kAlign;
+        if (k == 0 || k > kClasses) return ::operator new(bytes);
+        Heap& h = local().heap();
+        if (!h.free[k - 1]) refill(h, k);
+        Block* b = h.free[k - 1];
+        h.free[k - 1] = b->next;
+        return b;
+    }
+
+    static void deallocate(void* p, size_t bytes) {
+        size_t k = (bytes + kAlign - 1) / kAlign;
+        if (k == 0 || k > kClasses) {
+            ::operator delete(p);
+            return;
+        }
+        Block* b = static_cast<Block*>(p);
+        Heap* owner = reinterpret_cast<Slab*>(reinterpret_cast<uintptr_t>(p) & ~(uintptr_t)(kSlab - 1))->owner;
+        if (owner == local().h) {
+            b->next = owner->free[k - 1];
+            owner->free[k - 1] = b;
+            return;
+        }
+        std::atomic<Block*>& remote = owner->remote[k - 1];
+        b->next = remote.load(std::memory_order_relaxed);
+        while (!remote.compare_exchange_weak(b->next, b, std::memory_order_release, std::memory_order_relaxed)) {
+        }
+    }
+
+    // slabs carved so far, across all threads
+    static size_t slabs() {
+        return slab_count().load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Block {
+        Block* next;
+    };
+
+    // owned by one thread at a time and never freed, so remote frees always
+    // have somewhere to go
+    struct Heap {
+        Block* free[kClasses] = {};
+        std::atomic<Block*> remote[kClasses] = {};
+        char* cur = nullptr;
+        char* end = nullptr;
+        Heap* next_idle = nullptr;
+    };
+
+    // slabs are kSlab-aligned, so a block finds its header by masking
+    struct alignas(kAlign) Slab {
+        Heap* owner;
+    };
+
+    struct Local {
+        Heap* h = nullptr;
+
+        Heap& heap() {
+            if (!h) {
+                std::lock_guard<std::mutex> lock(idle_m());
+                h = idle();
+                if (h) {
+                    idle() = h->next_idle;
+                } else {
+                    h = new Heap;
+                }
+            }
+            return *h;
+        }
+
+        ~Local() {
+            if (!h) return;
+            std::lock_guard<std::mutex> lock(idle_m());
+            h->next_idle = idle();
+            idle() = h;
+        }
+    };
+
+    static Local& local() {
+        static thread_local Local l;
+        return l;
+    }
+
+    static std::mutex& idle_m() {
+        static std::mutex m;
+        return m;
+    }
+
+    static Heap*& idle() {
+        static Heap* heaps = nullptr;
+        return heaps;
+    }
+
+    static std::atomic<size_t>& slab_count() {
+        static std::atomic<size_t> n{0};
+        return n;
+    }
+
+    static void refill(Heap& h, size_t k) {
+        if (h.remote[k - 1].load(std::memory_order_relaxed)) {
+            h.free[k - 1] = h.remote[k - 1].exchange(nullptr, std::memory_order_acquire);
+            return;
+        }
+        size_t bytes = k * kAlign;
+        if (h.cur + bytes > h.end) {
+            // slabs live for the whole process; their blocks are recycled, never returned
+            h.cur = static_cast<char*>(::operator new(kSlab, std::align_val_t(kSlab)));
+            h.end = h.cur + kSlab;
+            reinterpret_cast<Slab*>(h.cur)->owner = &h;
+            h.cur += sizeof(Slab);
+            slab_count().fetch_add(1, std::memory_order_relaxed);
+        }
+        // carve a batch of blocks so the next allocations of this size are a pop
+        for (int i = 0; i < 32 && h.cur + bytes <= h.end; ++i) {
+            Block* b = reinterpret_cast<Block*>(h.cur);
+            h.cur += bytes;
+            b->next = h.free[k - 1];
+            h.free[k - 1] = b;
+        }
+    }
+};
+
+template <typename T>
+struct ArenaAllocator {
+    using value_type = T;
+
+    ArenaAllocator() = default;
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(NodeArena::allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, size_t n) {
+        NodeArena::deallocate(p, n * sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U>&) const { return true; }
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U>&) const { return false; }
+};
+
+// lock-free float accumulation for gradients shared between backward workers
+inline void atomic_add(float& target, float delta) {
+    float expected;
+    __atomic_load(&target, &expected, __ATOMIC_RELAXED);
+    float desired = expected + delta;
+    while (!__atomic_compare_exchange(&target, &expected, &desired, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        desired = expected + delta;
+    }
+}
+
+class Value;
+
+// records the op nodes built on one thread, in creation order, which is
+// always a valid topological order. while a tape runs backward with its sink
+// enabled, gradient for nodes it does not own (parameters, inputs) is
+// collected privately and only added to the shared nodes by reduce()
+class Tape {
+public:
+    std::vector<std::shared_ptr<Value>> nodes;
+    std::vector<Value*> sink_nodes;
+    std::vector<float> sink_grads;
+    std::unordered_map<Value*, int> sink_index;
+
+    // tape that new op nodes on this thread are recorded on
+    static inline thread_local Tape* active = nullptr;
+
+    // make the current thread record onto a tape for the lifetime of the scope.
+    // only nodes built by this thread are recorded, so build a tape's graph
+    // serially inside its scope
+    struct Scope {
+        Tape* prev;
+        Scope(Tape& tape) : prev(active) { active = &tape; }
+        ~Scope() { active = prev; }
+    };
+
+    void record(const std::shared_ptr<Value>& v);
+    void backward(bool sink);
+    void reduce();
+
+    void sink_add(Value* v, float delta) {
+        auto it = sink_index.find(v);
+        if (it == sink_index.end()) {
+            sink_index.emplace(v, (int)sink_nodes.size());
+            sink_nodes.push_back(v);
+            sink_grads.push_back(delta);
+        } else {
+            sink_grads[it->second] += delta;
+        }
+    }
+
+    void clear() {
+        nodes.clear();
+        sink_nodes.clear();
+        sink_grads.clear();
+        sink_index.clear();
+    }
+};
 
 class Value {
 public:
     float data;
     float grad;
     std::function<void()> _backward;
-    std::set<std::shared_ptr<Value>> _prev;
+    // children in argument order (deduplicated), so traversal never depends on heap addresses
+    std::vector<std::shared_ptr<Value>> _prev;
     std::string _op;
+    Tape* _tape = nullptr;
+
+    // set on backward_parallel workers so that parents running concurrently
+    // can accumulate into a shared child
+    static inline thread_local bool atomic_grads = false;
+    // tape whose private sink receives gradient for nodes it does not own
+    static inline thread_local Tape* sink = nullptr;
+
+    void accum(float delta) {
+        if (sink && _tape != sink) {
+            sink->sink_add(this, delta);
+        } else if (atomic_grads) {
+            atomic_add(grad, delta);
+        } else {
+            grad += delta;
+        }
+    }
 
     Value(float data) : data(data), grad(0), _backward([](){}), _op("") {}
 
     Value(float data, std::vector<std::shared_ptr<Value>> children, std::string op) 
     : data(data), grad(0), _backward([](){}), _op(op) {
         for (auto& child : children) {
-            _prev.insert(child);
+            if (std::find(_prev.begin(), _prev.end(), child) == _prev.end()) {
+                _prev.push_back(child);
+            }
+        }
+    }
+
+    // a graph is usually one long chain (the running sums in Neuron and
+    // loss()), so release children iteratively instead of recursing through
+    // one destructor per node
+    ~Value() {
+        static thread_local std::vector<std::shared_ptr<Value>> dying;
+        static thread_local bool draining = false;
+        for (auto& child : _prev) {
+            dying.push_back(std::move(child));
+        }
+        _prev.clear();
+        if (draining) return;
+        draining = true;
+        while (!dying.empty()) {
+            auto v = std::move(dying.back());
+            dying.pop_back();
+        }
+        draining = false;
+    }
+
+    // op nodes come from the thread's arena and land on its active tape
+    static std::shared_ptr<Value> node(float data, std::vector<std::shared_ptr<Value>> children, std::string op) {
+        auto out = std::allocate_shared<Value>(ArenaAllocator<Value>(), data, std::move(children), std::move(op));
+        if (Tape::active) {
+            Tape::active->record(out);
         }
+        return out;
     }
 
     std::shared_ptr<Value> create_shared() {
@@ -28,28 +669,30 @@ public:
     }
 
     static std::shared_ptr<Value> add(std::shared_ptr<Value> self, std::shared_ptr<Value> other) {
-        auto out = std::make_shared<Value>(self->data + other->data, std::vector<std::shared_ptr<Value>>{self, other}, "+");
+        auto out = node(self->data + other->data, {self, other}, "+");
 
-        out->_backward = [self, other, out]() {
-            self->grad += out->grad;
-            other->grad += out->grad;
+        // raw pointers: _prev keeps the children alive, and capturing out itself would be a cycle
+        out->_backward = [self = self.get(), other = other.get(), out = out.get()]() {
+            self->accum(out->grad);
+            other->accum(out->grad);
         };
 
         return out;
     }
 
     static std::shared_ptr<Value> multiply(std::shared_ptr<Value> self, std::shared_ptr<Value> other) {
-        auto out = std::make_shared<Value>(self->data * other->data, std::vector<std::shared_ptr<Value>>{self, other}, "*");
+        auto out = node(self->data * other->data, {self, other}, "*");
 
-        out->_backward = [self, other, out]() {
-            self->grad += other->data * out->grad;
-            other->grad += self->data * out->grad;
+        out->_backward = [self = self.get(), other = other.get(), out = out.get()]() {
+            self->accum(other->data * out->grad);
+            other->accum(self->data * out->grad);
         };
 
         return out;
     }
 
-    void backward(std::shared_ptr<Value> self) {
+    // seed scales the root gradient, e.g. 1/N when accumulating N micro-batches
+    void backward(std::shared_ptr<Value> self, float seed = 1) {
         // topsort order 
         std::vector<std::shared_ptr<Value>> topo;
         std::set<std::shared_ptr<Value>> visited;
@@ -66,14 +709,247 @@ public:
         
         build_topo(self);
 
-        grad = 1;
+        grad = seed;
         for (auto it = topo.rbegin(); it != topo.rend(); ++it) {
             (*it)->_backward();
         }
     }
 
+    // same result as backward(), but nodes run on the pool as soon as all of
+    // their parents have pushed gradient into them (in-degree counting).
+    // seed is as for backward()
+    void backward_parallel(std::shared_ptr<Value> self, ThreadPool& pool = ThreadPool::global(), float seed = 1) {
+        // iterative dfs so very deep graphs don't blow the stack
+        std::vector<Value*> nodes;
+        std::unordered_map<Value*, int> index;
+        std::vector<Value*> stack{self.get()};
+        index[self.get()] = 0;
+        nodes.push_back(self.get());
+        while (!stack.empty()) {
+            Value* v = stack.back();
+            stack.pop_back();
+            for (auto& child : v->_prev) {
+                if (index.emplace(child.get(), (int)nodes.size()).second) {
+                    nodes.push_back(child.get());
+                    stack.push_back(child.get());
+                }
+            }
+        }
+
+        // children in csr form plus the number of parents each node waits on
+        int n = (int)nodes.size();
+        std::vector<int> offsets(n + 1, 0);
+        std::vector<int> children;
+        std::unique_ptr<std::atomic<int>[]> waiting(new std::atomic<int>[n]);
+        for (int i = 0; i < n; ++i) {
+            waiting[i].store(0, std::memory_order_relaxed);
+        }
+        for (int i = 0; i < n; ++i) {
+            for (auto& child : nodes[i]->_prev) {
+                int c = index[child.get()];
+                children.push_back(c);
+                waiting[c].fetch_add(1, std::memory_order_relaxed);
+            }
+            offsets[i + 1] = (int)children.size();
+        }
+
+        std::atomic<int> remaining(n);
+        std::function<void(int)> run;
+        run = [&](int i) {
+            bool was_atomic = atomic_grads;
+            atomic_grads = true;
+            while (i >= 0) {
+                nodes[i]->_backward();
+                // keep one newly ready child for this thread, hand the rest to the pool
+                int keep = -1;
+                for (int k = offsets[i]; k < offsets[i + 1]; ++k) {
+                    int c = children[k];
+                    if (waiting[c].fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                        if (keep < 0) {
+                            keep = c;
+                        } else {
+                            pool.submit([&run, c]() { run(c); });
+                        }
+                    }
+                }
+                remaining.fetch_sub(1, std::memory_order_release);
+                i = keep;
+            }
+            atomic_grads = was_atomic;
+        };
+
+        grad = seed;
+        run(0);
+        pool.help_until([&]() { return remaining.load(std::memory_order_acquire) == 0; });
+    }
+
+};
+
+inline void Tape::record(const std::shared_ptr<Value>& v) {
+    v->_tape = this;
+    nodes.push_back(v);
+}
+
+// run the recorded nodes in reverse; with sink set, gradient leaving the tape
+// is kept in sink_grads until reduce()
+inline void Tape::backward(bool sink) {
+    Tape* prev = Value::sink;
+    Value::sink = sink ? this : nullptr;
+    for (auto it = nodes.rbegin(); it != nodes.rend(); ++it) {
+        (*it)->_backward();
+    }
+    Value::sink = prev;
+}
+
+inline void Tape::reduce() {
+    for (int i = 0; i < sink_nodes.size(); ++i) {
+        sink_nodes[i]->grad += sink_grads[i];
+    }
+    sink_nodes.clear();
+    sink_grads.clear();
+    sink_index.clear();
+}
+
+// the tapes of one loss() evaluation: one per sample plus the tape of the
+// code combining them. backward is parallel over samples, and because every
+// sample keeps its parameter gradients private until they are reduced in
+// sample order, the result is bit-identical for any number of threads
+struct TapeSet {
+    Tape main;
+    std::vector<std::unique_ptr<Tape>> samples;
+
+    void backward(std::shared_ptr<Value> root, ThreadPool& pool = ThreadPool::global()) {
+        root->grad = 1;
+        // the combining graph runs serially and seeds each sample's output
+        main.backward(false);
+        pool.parallel_for((int)samples.size(), [this](int i) {
+            samples[i]->backward(true);
+        }, 1);
+        for (auto& tape : samples) {
+            tape->reduce();
+        }
+    }
+};
+
+// expression templates over Value handles: with them, a + b * c on
+// shared_ptr<Value>s (and floats) builds a compile-time tree instead of one
+// node per operator. converting the tree to a shared_ptr<Value> makes a
+// single "fused" node whose forward and backward are the tree's eval() and
+// backprop(), inlined by the compiler. the node's children are the leaves,
+// so backward(), tapes and backward_parallel treat it like any other op
+template <typename E>
+struct ValueExpr {
+    const E& self() const { return static_cast<const E&>(*this); }
+
+    // materialize: one node for the whole expression
+    operator std::shared_ptr<Value>() const {
+        std::vector<std::shared_ptr<Value>> leaves;
+        self().leaves(leaves);
+        auto out = Value::node(self().eval(), std::move(leaves), "fused");
+        // the closure keeps raw leaf pointers only, as add() and multiply() do
+        E body = self();
+        body.release();
+        out->_backward = [body, out = out.get()]() {
+            body.backprop(out->grad);
+        };
+        return out;
+    }
+};
+
+struct LeafExpr : ValueExpr<LeafExpr> {
+    std::shared_ptr<Value> ref;     // dropped once the node owns the leaf through _prev
+    Value* v;
+
+    LeafExpr(const std::shared_ptr<Value>& v) : ref(v), v(v.get()) {}
+
+    float eval() const { return v->data; }
+    void backprop(float g) const { v->accum(g); }
+    void leaves(std::vector<std::shared_ptr<Value>>& out) const { out.push_back(ref); }
+    void release() { ref.reset(); }
+};
+
+struct ConstExpr : ValueExpr<ConstExpr> {
+    float c;
+
+    ConstExpr(float c) : c(c) {}
+
+    float eval() const { return c; }
+    void backprop(float) const {}
+    void leaves(std::vector<std::shared_ptr<Value>>&) const {}
+    void release() {}
+};
+
+template <typename L, typename R>
+struct AddExpr : ValueExpr<AddExpr<L, R>> {
+    L l;
+    R r;
+
+    AddExpr(L l, R r) : l(std::move(l)), r(std::move(r)) {}
+
+    float eval() const { return l.eval() + r.eval(); }
+    void backprop(float g) const {
+        l.backprop(g);
+        r.backprop(g);
+    }
+    void leaves(std::vector<std::shared_ptr<Value>>& out) const {
+        l.leaves(out);
+        r.leaves(out);
+    }
+    void release() {
+        l.release();
+        r.release();
+    }
+};
+
+// operands are re-evaluated in backward, as multiply() reads its children's
+// data when it runs
+template <typename L, typename R>
+struct MulExpr : ValueExpr<MulExpr<L, R>> {
+    L l;
+    R r;
+
+    MulExpr(L l, R r) : l(std::move(l)), r(std::move(r)) {}
+
+    float eval() const { return l.eval() * r.eval(); }
+    void backprop(float g) const {
+        l.backprop(g * r.eval());
+        r.backprop(g * l.eval());
+    }
+    void leaves(std::vector<std::shared_ptr<Value>>& out) const {
+        l.leaves(out);
+        r.leaves(out);
+    }
+    void release() {
+        l.release();
+        r.release();
+    }
 };
 
+// what an operand becomes inside a tree
+template <typename E>
+const E& as_expr(const ValueExpr<E>& e) { return e.self(); }
+inline LeafExpr as_expr(const std::shared_ptr<Value>& v) { return LeafExpr(v); }
+inline ConstExpr as_expr(float c) { return ConstExpr(c); }
+
+template <typename T>
+using expr_of = std::decay_t<decltype(as_expr(std::declval<const T&>()))>;
+
+// at least one side must already be a Value handle or an expression, so
+// float + float and unrelated types are left alone
+template <typename T>
+constexpr bool is_value_operand = std::is_same_v<std::decay_t<T>, std::shared_ptr<Value>>
+    || std::is_base_of_v<ValueExpr<std::decay_t<T>>, std::decay_t<T>>;
+
+template <typename A, typename B, typename = std::enable_if_t<is_value_operand<A> || is_value_operand<B>>>
+AddExpr<expr_of<A>, expr_of<B>> operator+(const A& a, const B& b) {
+    return {as_expr(a), as_expr(b)};
+}
+
+template <typename A, typename B, typename = std::enable_if_t<is_value_operand<A> || is_value_operand<B>>>
+MulExpr<expr_of<A>, expr_of<B>> operator*(const A& a, const B& b) {
+    return {as_expr(a), as_expr(b)};
+}
+
 class Module {
 public:
     virtual void zero_grad() {
@@ -140,6 +1016,16 @@ public:
         return out;
     }
 
+    // neurons are independent, so each one can be built on its own worker;
+    // the outputs already form one graph sharing x and the parameters
+    std::vector<std::shared_ptr<Value>> forward_parallel(std::vector<std::shared_ptr<Value>> x, ThreadPool& pool = ThreadPool::global()) {
+        std::vector<std::shared_ptr<Value>> out(neurons.size());
+        pool.parallel_for((int)neurons.size(), [&](int i) {
+            out[i] = (*neurons[i])(x);
+        });
+        return out;
+    }
+
     std::vector<std::shared_ptr<Value>> parameters() override {
         std::vector<std::shared_ptr<Value>> out;
         for (auto& neuron : neurons) {
@@ -177,6 +1063,13 @@ public:
         return x;
     }
 
+    std::vector<std::shared_ptr<Value>> forward_parallel(std::vector<std::shared_ptr<Value>> x, ThreadPool& pool = ThreadPool::global()) {
+        for (auto& layer : layers) {
+            x = layer->forward_parallel(x, pool);
+        }
+        return x;
+    }
+
     std::vector<std::shared_ptr<Value>> parameters() override {
         std::vector<std::shared_ptr<Value>> out;
         for (auto& layer : layers) {
@@ -192,26 +1085,4193 @@ public:
     }
 };
 
-// test grad calculation
-void test_grad() {
-    auto a = std::make_shared<Value>(1.0);
-    auto b = std::make_shared<Value>(2.0);
-    auto c = std::make_shared<Value>(3.0);
-    auto d = std::make_shared<Value>(4.0);
+// a fixed-shape MLP with the same semantics as MLP (each neuron is b + w.x,
+// weights start at 1 and biases at 0) for small deployed models. shapes are
+// template arguments, so weights live in std::arrays inside the object, every
+// loop has a compile-time trip count the compiler unrolls, and there is no
+// heap, no Value and no virtual call. backward is analytic and needs the
+// activations of the forward() just before it
+template <int Nin, int Nout>
+struct StaticLayer {
+    // input-major: w[i][o] is neuron o's weight for input i, so the inner
+    // loops run over outputs and vectorize
+    std::array<std::array<float, Nout>, Nin> w;
+    std::array<float, Nout> b{};
+    std::array<std::array<float, Nout>, Nin> w_grad{};
+    std::array<float, Nout> b_grad{};
 
-    auto e = Value::add(a, b);
-    auto f = Value::multiply(c, d);
-    auto g = Value::add(e, f);
+    StaticLayer() {
+        for (auto& row : w) row.fill(1.0f);
+    }
 
-    g->backward(g);
+    std::array<float, Nout> forward(const std::array<float, Nin>& x) const {
+        std::array<float, Nout> y = b;
+        for (int i = 0; i < Nin; ++i) {
+            for (int o = 0; o < Nout; ++o) y[o] += w[i][o] * x[i];
+        }
+        return y;
+    }
 
-    assert(a->grad == 1);
-    assert(b->grad == 1);
-    assert(c->grad == 4);
-    assert(d->grad == 3);
+    // accumulates parameter gradients, returns d loss / d x
+    std::array<float, Nin> backward(const std::array<float, Nin>& x, const std::array<float, Nout>& dy) {
+        std::array<float, Nin> dx{};
+        for (int o = 0; o < Nout; ++o) b_grad[o] += dy[o];
+        for (int i = 0; i < Nin; ++i) {
+            for (int o = 0; o < Nout; ++o) {
+                w_grad[i][o] += dy[o] * x[i];
+                dx[i] += dy[o] * w[i][o];
+            }
+        }
+        return dx;
+    }
+};
 
-    std::cout << "Passed: test_grad" << std::endl;
-}
+template <int Nin, int... Nouts>
+class StaticMLP {
+public:
+    static constexpr int nlayers = sizeof...(Nouts);
+    static constexpr std::array<int, nlayers + 1> sizes{Nin, Nouts...};
+    static constexpr int nout = sizes[nlayers];
+    static constexpr int num_params = [] {
+        int n = 0;
+        for (int l = 0; l < nlayers; ++l) n += sizes[l + 1] * (sizes[l] + 1);
+        return n;
+    }();
+
+    using Input = std::array<float, Nin>;
+    using Output = std::array<float, nout>;
+
+    Output forward(const Input& x) {
+        input = x;
+        return forward_from<0>(x);
+    }
+
+    // d loss / d output for the last forward(); returns d loss / d input
+    Input backward(const Output& dy) {
+        return backward_from<nlayers - 1>(dy);
+    }
+
+    void zero_grad() {
+        each([](auto& layer) {
+            for (auto& row : layer.w_grad) row.fill(0);
+            layer.b_grad.fill(0);
+        });
+    }
+
+    void step(float lr) {
+        each([lr](auto& layer) {
+            for (size_t i = 0; i < layer.w.size(); ++i) {
+                for (size_t o = 0; o < layer.b.size(); ++o) layer.w[i][o] -= lr * layer.w_grad[i][o];
+            }
+            for (size_t o = 0; o < layer.b.size(); ++o) layer.b[o] -= lr * layer.b_grad[o];
+        });
+    }
+
+    // weights in MLP::parameters() order: per neuron its weights, then its bias
+    void load(const MLP& model) {
+        if (model.layers.size() != nlayers) throw std::runtime_error("StaticMLP: layer count does not match");
+        int l = 0;
+        each([&](auto& layer) {
+            auto& neurons = model.layers[l++]->neurons;
+            if (neurons.size() != layer.b.size() || neurons[0]->w.size() != layer.w.size()) {
+                throw std::runtime_error("StaticMLP: layer shape does not match");
+            }
+            for (size_t o = 0; o < layer.b.size(); ++o) {
+                for (size_t i = 0; i < layer.w.size(); ++i) layer.w[i][o] = neurons[o]->w[i]->data;
+                layer.b[o] = neurons[o]->b->data;
+            }
+        });
+    }
+
+    // gradients in MLP::parameters() order
+    std::vector<float> grads() {
+        std::vector<float> out;
+        out.reserve(num_params);
+        each([&](auto& layer) {
+            for (size_t o = 0; o < layer.b.size(); ++o) {
+                for (size_t i = 0; i < layer.w.size(); ++i) out.push_back(layer.w_grad[i][o]);
+                out.push_back(layer.b_grad[o]);
+            }
+        });
+        return out;
+    }
+
+private:
+    template <size_t... I>
+    static auto layer_types(std::index_sequence<I...>) -> std::tuple<StaticLayer<sizes[I], sizes[I + 1]>...>;
+    template <size_t... I>
+    static auto activation_types(std::index_sequence<I...>) -> std::tuple<std::array<float, sizes[I + 1]>...>;
+
+    decltype(layer_types(std::make_index_sequence<nlayers>{})) layers;
+    decltype(activation_types(std::make_index_sequence<nlayers>{})) acts;     // output of each layer
+    Input input{};
+
+    template <size_t L, typename In>
+    auto forward_from(const In& x) {
+        std::get<L>(acts) = std::get<L>(layers).forward(x);
+        if constexpr (L + 1 < nlayers) {
+            return forward_from<L + 1>(std::get<L>(acts));
+        } else {
+            return std::get<L>(acts);
+        }
+    }
+
+    template <size_t L, typename Out>
+    Input backward_from(const Out& dy) {
+        if constexpr (L == 0) {
+            return std::get<0>(layers).backward(input, dy);
+        } else {
+            return backward_from<L - 1>(std::get<L>(layers).backward(std::get<L - 1>(acts), dy));
+        }
+    }
+
+    template <typename Fn>
+    void each(Fn&& fn) {
+        std::apply([&](auto&... layer) { (fn(layer), ...); }, layers);
+    }
+};
+
+// plain sgd with optional momentum; the per-parameter update runs on the pool
+class SGD {
+public:
+    std::vector<std::shared_ptr<Value>> params;
+    float lr;
+    float momentum;
+    std::vector<float> velocity;
+
+    SGD(std::vector<std::shared_ptr<Value>> params, float lr, float momentum=0) : params(params), lr(lr), momentum(momentum), velocity(params.size(), 0) {}
+
+    void step(ThreadPool& pool = ThreadPool::global()) {
+        pool.parallel_for((int)params.size(), [this](int i) {
+            velocity[i] = momentum * velocity[i] + params[i]->grad;
+            params[i]->data -= lr * velocity[i];
+        }, 4096);
+    }
+
+    void zero_grad() {
+        for (auto& p : params) {
+            p->grad = 0;
+        }
+    }
+};
+
+// gradient accumulation over micro-batches: each micro-batch loss is
+// backpropagated straight into the parameter grads (scaled so the sum is a
+// mean over micro-batches) and its graph is released right away, so memory
+// stays proportional to one micro-batch. the optimizer steps, and grads are
+// reset, once every `steps` micro-batches
+class GradAccumulator {
+public:
+    SGD& opt;
+    int steps;
+    int count;
+
+    GradAccumulator(SGD& opt, int steps) : opt(opt), steps(steps), count(0) {}
+
+    // consumes the loss handle; returns true when this micro-batch completed a step
+    bool backward(std::shared_ptr<Value>& loss) {
+        loss->backward(loss, 1.0f / steps);
+        loss.reset();
+        if (++count < steps) return false;
+        count = 0;
+        opt.step();
+        opt.zero_grad();
+        return true;
+    }
+};
+
+// flat views of the parameter grads / values, in parameters() order; this is
+// the buffer layout everything that moves parameters between processes uses
+inline void gather_grads(const std::vector<std::shared_ptr<Value>>& params, std::vector<float>& flat) {
+    flat.resize(params.size());
+    for (int i = 0; i < params.size(); ++i) {
+        flat[i] = params[i]->grad;
+    }
+}
+
+inline void scatter_grads(const std::vector<float>& flat, const std::vector<std::shared_ptr<Value>>& params) {
+    for (int i = 0; i < params.size(); ++i) {
+        params[i]->grad = flat[i];
+    }
+}
+
+inline void gather_data(const std::vector<std::shared_ptr<Value>>& params, std::vector<float>& flat) {
+    flat.resize(params.size());
+    for (int i = 0; i < params.size(); ++i) {
+        flat[i] = params[i]->data;
+    }
+}
+
+inline void scatter_data(const std::vector<float>& flat, const std::vector<std::shared_ptr<Value>>& params) {
+    for (int i = 0; i < params.size(); ++i) {
+        params[i]->data = flat[i];
+    }
+}
+
+// lossy encodings of a flat gradient for cross-process traffic. encoders
+// keep the part of the gradient they could not send (error feedback) and add
+// it to the next one, so nothing is lost, only delayed
+class GradCompressor {
+public:
+    virtual ~GradCompressor() = default;
+
+    virtual std::vector<char> encode(const std::vector<float>& grad) = 0;
+
+    // out += decoded message
+    virtual void decode_add(const std::vector<char>& msg, std::vector<float>& out) = 0;
+
+    virtual std::string repr() = 0;
+
+protected:
+    std::vector<float> residual;
+
+    // grad plus whatever earlier messages left out
+    std::vector<float> with_feedback(const std::vector<float>& grad) {
+        residual.resize(grad.size(), 0);
+        std::vector<float> acc(grad.size());
+        for (size_t i = 0; i < grad.size(); ++i) {
+            acc[i] = grad[i] + residual[i];
+        }
+        return acc;
+    }
+
+    template <typename T>
+    static void put(std::vector<char>& buf, const T& v) {
+        const char* p = reinterpret_cast<const char*>(&v);
+        buf.insert(buf.end(), p, p + sizeof(T));
+    }
+
+    template <typename T>
+    static T get(const std::vector<char>& buf, size_t& at) {
+        if (buf.size() < sizeof(T) || at > buf.size() - sizeof(T)) throw std::runtime_error("GradCompressor: truncated message");
+        T v;
+        std::memcpy(&v, buf.data() + at, sizeof(T));
+        at += sizeof(T);
+        return v;
+    }
+};
+
+// keep the k = ratio * n largest entries as (index, value) pairs. decode_add
+// checks the count and every index against n, and n against out when out is
+// already sized
+class TopKCompressor : public GradCompressor {
+public:
+    float ratio;
+
+    TopKCompressor(float ratio=0.01f) : ratio(ratio) {}
+
+    std::vector<char> encode(const std::vector<float>& grad) override {
+        auto acc = with_feedback(grad);
+        uint32_t n = (uint32_t)acc.size();
+        std::vector<char> msg;
+        put(msg, n);
+        if (n == 0) {
+            put(msg, n);
+            return msg;
+        }
+        uint32_t k = std::min<uint32_t>(n, std::max<uint32_t>(1, (uint32_t)(ratio * n)));
+        std::vector<uint32_t> idx(n);
+        for (uint32_t i = 0; i < n; ++i) idx[i] = i;
+        std::nth_element(idx.begin(), idx.begin() + (k - 1), idx.end(), [&](uint32_t a, uint32_t b) {
+            return std::abs(acc[a]) > std::abs(acc[b]);
+        });
+        idx.resize(k);
+        std::sort(idx.begin(), idx.end());
+        put(msg, k);
+        residual = acc;
+        for (auto i : idx) {
+            put(msg, i);
+            put(msg, acc[i]);
+            residual[i] = 0;
+        }
+        return msg;
+    }
+
+    void decode_add(const std::vector<char>& msg, std::vector<float>& out) override {
+        size_t at = 0;
+        uint32_t n = get<uint32_t>(msg, at);
+        uint32_t k = get<uint32_t>(msg, at);
+        size_t entry = sizeof(uint32_t) + sizeof(float);
+        if (k > n || (msg.size() - at) / entry != k || (msg.size() - at) % entry != 0 || (!out.empty() && out.size() != n)) {
+            throw std::runtime_error("TopKCompressor: malformed message");
+        }
+        out.resize(n, 0);
+        for (uint32_t j = 0; j < k; ++j) {
+            uint32_t i = get<uint32_t>(msg, at);
+            if (i >= n) throw std::runtime_error("TopKCompressor: index out of range");
+            out[i] += get<float>(msg, at);
+        }
+    }
+
+    std::string repr() override {
+        return "TopK";
+    }
+};
+
+// linear 8-bit quantization with one scale per block of 256 values
+class Int8Compressor : public GradCompressor {
+public:
+    static constexpr uint32_t kBlock = 256;
+
+    std::vector<char> encode(const std::vector<float>& grad) override {
+        auto acc = with_feedback(grad);
+        uint32_t n = (uint32_t)acc.size();
+        std::vector<char> msg;
+        put(msg, n);
+        for (uint32_t start = 0; start < n; start += kBlock) {
+            uint32_t end = std::min(n, start + kBlock);
+            float maxabs = 0;
+            for (uint32_t i = start; i < end; ++i) maxabs = std::max(maxabs, std::abs(acc[i]));
+            float scale = maxabs > 0 ? maxabs / 127 : 1;
+            put(msg, scale);
+            for (uint32_t i = start; i < end; ++i) {
+                int8_t q = (int8_t)std::lround(acc[i] / scale);
+                msg.push_back((char)q);
+                residual[i] = acc[i] - q * scale;
+            }
+        }
+        return msg;
+    }
+
+    void decode_add(const std::vector<char>& msg, std::vector<float>& out) override {
+        size_t at = 0;
+        uint32_t n = get<uint32_t>(msg, at);
+        out.resize(n, 0);
+        for (uint32_t start = 0; start < n; start += kBlock) {
+            uint32_t end = std::min(n, start + kBlock);
+            float scale = get<float>(msg, at);
+            for (uint32_t i = start; i < end; ++i) {
+                out[i] += (int8_t)msg[at++] * scale;
+            }
+        }
+    }
+
+    std::string repr() override {
+        return "Int8";
+    }
+};
+
+// 1-bit sign sgd: one bit per entry plus a single scale (the mean magnitude)
+class SignCompressor : public GradCompressor {
+public:
+    std::vector<char> encode(const std::vector<float>& grad) override {
+        auto acc = with_feedback(grad);
+        uint32_t n = (uint32_t)acc.size();
+        float scale = 0;
+        for (auto v : acc) scale += std::abs(v);
+        scale = n ? scale / n : 0;
+        std::vector<char> msg;
+        put(msg, n);
+        put(msg, scale);
+        std::vector<uint8_t> bits((n + 7) / 8, 0);
+        for (uint32_t i = 0; i < n; ++i) {
+            bool negative = acc[i] < 0;
+            if (negative) bits[i / 8] |= (uint8_t)(1u << (i % 8));
+            residual[i] = acc[i] - (negative ? -scale : scale);
+        }
+        msg.insert(msg.end(), bits.begin(), bits.end());
+        return msg;
+    }
+
+    void decode_add(const std::vector<char>& msg, std::vector<float>& out) override {
+        size_t at = 0;
+        uint32_t n = get<uint32_t>(msg, at);
+        float scale = get<float>(msg, at);
+        out.resize(n, 0);
+        for (uint32_t i = 0; i < n; ++i) {
+            bool negative = (uint8_t)msg[at + i / 8] & (1u << (i % 8));
+            out[i] += negative ? -scale : scale;
+        }
+    }
+
+    std::string repr() override {
+        return "Sign";
+    }
+};
+
+// one process in a ring of `world` processes for data-parallel training.
+// rank r connects to r+1 and accepts r-1; addresses holds one listen
+// address per rank, "unix:/path" or "tcp:host:port"
+class Communicator {
+public:
+    int rank;
+    int world;
+    // floats per pipelined chunk; a chunk is reduced as soon as it arrives and
+    // forwarded while the rest of the segment is still on the wire
+    size_t chunk_floats = 16384;
+
+    struct Stats {
+        double bytes = 0;       // payload of the last allreduce
+        double seconds = 0;
+        double algbw = 0;       // GB/s, bytes / seconds
+        double busbw = 0;       // GB/s, algbw * 2(world-1)/world: per-link traffic of a ring
+    };
+    Stats last;
+    uint64_t bytes_sent = 0;    // everything this rank has put on the wire
+
+    Communicator(int rank, int world, std::vector<std::string> addresses) : rank(rank), world(world) {
+        assert(addresses.size() == world && rank >= 0 && rank < world);
+        if (world == 1) return;
+        // no destructor runs if this throws, so close what is open by hand
+        try {
+            listen_on(addresses[rank]);
+            right_fd = connect_to(addresses[(rank + 1) % world]);
+            left_fd = ::accept(listen_fd, nullptr, nullptr);
+            if (left_fd < 0) fail("accept");
+            for (int fd : {left_fd, right_fd}) {
+                configure(fd);
+            }
+        } catch (...) {
+            close_all();
+            throw;
+        }
+    }
+
+    // listen addresses for a ring of local processes over unix sockets
+    static std::vector<std::string> unix_addresses(const std::string& prefix, int world) {
+        std::vector<std::string> out;
+        for (int r = 0; r < world; ++r) {
+            out.push_back("unix:" + prefix + "." + std::to_string(r));
+        }
+        return out;
+    }
+
+    static std::vector<std::string> tcp_addresses(const std::string& host, int base_port, int world) {
+        std::vector<std::string> out;
+        for (int r = 0; r < world; ++r) {
+            out.push_back("tcp:" + host + ":" + std::to_string(base_port + r));
+        }
+        return out;
+    }
+
+    ~Communicator() {
+        close_all();
+    }
+
+    Communicator(const Communicator&) = delete;
+    Communicator& operator=(const Communicator&) = delete;
+
+    // in-place sum across all ranks: reduce-scatter then all-gather around the
+    // ring, 2(world-1) steps. all steps form one stream per link, and a chunk
+    // may be sent on as soon as the chunk it depends on has been received
+    void allreduce(float* buf, size_t n) {
+        auto start = std::chrono::steady_clock::now();
+        if (world > 1 && n > 0) {
+            ring(buf, even_offsets(n), world - 1, world - 1, 0);
+        }
+        record(start, n, 2.0 * (world - 1) / world);
+    }
+
+    // segment r = [offsets[r], offsets[r+1]) is filled in by rank r; afterwards
+    // every rank holds every segment
+    void allgather(float* buf, const std::vector<size_t>& offsets) {
+        auto start = std::chrono::steady_clock::now();
+        if (world > 1) {
+            ring(buf, offsets, 0, world - 1, -1);
+        }
+        record(start, offsets.back(), (double)(world - 1) / world);
+    }
+
+    // sums buf across ranks, but each rank only ends up with its own segment
+    // [offsets[rank], offsets[rank+1]) of the result; the rest is scratch
+    void reduce_scatter(float* buf, const std::vector<size_t>& offsets) {
+        auto start = std::chrono::steady_clock::now();
+        if (world > 1) {
+            ring(buf, offsets, world - 1, 0, -1);
+        }
+        record(start, offsets.back(), (double)(world - 1) / world);
+    }
+
+    // offsets splitting n items into world nearly equal segments
+    std::vector<size_t> even_offsets(size_t n) const {
+        std::vector<size_t> out;
+        for (int r = 0; r <= world; ++r) {
+            out.push_back(n * r / world);
+        }
+        return out;
+    }
+
+    // every rank contributes one variable-size blob and gets all of them back,
+    // indexed by rank; blobs travel world-1 hops around the ring
+    std::vector<std::vector<char>> allgather_bytes(std::vector<char> mine) {
+        std::vector<std::vector<char>> out(world);
+        out[rank] = std::move(mine);
+        for (int step = 0; step + 1 < world; ++step) {
+            auto& send = out[((rank - step) % world + world) % world];
+            auto& recv = out[((rank - step - 1) % world + world) % world];
+            uint64_t send_n = send.size(), recv_n = 0;
+            duplex(reinterpret_cast<const char*>(&send_n), sizeof(send_n), reinterpret_cast<char*>(&recv_n), sizeof(recv_n));
+            recv.resize(recv_n);
+            duplex(send.data(), send.size(), recv.data(), recv.size());
+        }
+        return out;
+    }
+
+    // data-parallel step with compressed gradients: compressed messages do not
+    // add up, so they are all-gathered and every rank decodes and sums them
+    void allreduce_grads(const std::vector<std::shared_ptr<Value>>& params, GradCompressor& compressor) {
+        auto start = std::chrono::steady_clock::now();
+        gather_grads(params, flat);
+        auto msgs = allgather_bytes(compressor.encode(flat));
+        std::fill(flat.begin(), flat.end(), 0.0f);
+        for (auto& msg : msgs) {
+            compressor.decode_add(msg, flat);
+        }
+        for (auto& g : flat) {
+            g /= world;
+        }
+        scatter_grads(flat, params);
+        record(start, 0, 0);
+        last.bytes = (double)msgs[rank].size();
+    }
+
+    // data-parallel step: replace every grad by its mean over the ranks
+    void allreduce_grads(const std::vector<std::shared_ptr<Value>>& params) {
+        gather_grads(params, flat);
+        allreduce(flat.data(), flat.size());
+        for (auto& g : flat) {
+            g /= world;
+        }
+        scatter_grads(flat, params);
+    }
+
+private:
+    int left_fd = -1;
+    int right_fd = -1;
+    int listen_fd = -1;
+    std::string unix_path;
+    std::vector<float> flat;
+    std::vector<float> scratch;
+
+    [[noreturn]] static void fail(const std::string& what) {
+        throw std::runtime_error("Communicator: " + what + ": " + std::strerror(errno));
+    }
+
+    static void configure(int fd) {
+        int one = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));  // fails harmlessly on unix sockets
+        int flags = ::fcntl(fd, F_GETFL, 0);
+        ::fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    }
+
+    // "tcp:host:port" -> sockaddr_in, "unix:/path" -> sockaddr_un
+    static int make_addr(const std::string& address, sockaddr_storage& addr, socklen_t& len) {
+        std::memset(&addr, 0, sizeof(addr));
+        if (address.rfind("unix:", 0) == 0) {
+            auto* un = reinterpret_cast<sockaddr_un*>(&addr);
+            std::string path = address.substr(5);
+            if (path.size() >= sizeof(un->sun_path)) throw std::runtime_error("Communicator: unix path too long: " + path);
+            un->sun_family = AF_UNIX;
+            std::strcpy(un->sun_path, path.c_str());
+            len = sizeof(sockaddr_un);
+            return AF_UNIX;
+        }
+        if (address.rfind("tcp:", 0) == 0) {
+            auto colon = address.rfind(':');
+            std::string host = address.substr(4, colon - 4);
+            auto* in = reinterpret_cast<sockaddr_in*>(&addr);
+            in->sin_family = AF_INET;
+            in->sin_port = htons((uint16_t)std::stoi(address.substr(colon + 1)));
+            addrinfo hints{};
+            hints.ai_family = AF_INET;
+            addrinfo* res = nullptr;
+            if (::getaddrinfo(host.c_str(), nullptr, &hints, &res) != 0 || !res) {
+                throw std::runtime_error("Communicator: cannot resolve " + host);
+            }
+            in->sin_addr = reinterpret_cast<sockaddr_in*>(res->ai_addr)->sin_addr;
+            ::freeaddrinfo(res);
+            len = sizeof(sockaddr_in);
+            return AF_INET;
+        }
+        throw std::runtime_error("Communicator: bad address " + address);
+    }
+
+    void listen_on(const std::string& address) {
+        sockaddr_storage addr;
+        socklen_t len;
+        int family = make_addr(address, addr, len);
+        listen_fd = ::socket(family, SOCK_STREAM, 0);
+        if (listen_fd < 0) fail("socket");
+        if (family == AF_UNIX) {
+            unix_path = address.substr(5);
+            ::unlink(unix_path.c_str());
+        } else {
+            int one = 1;
+            ::setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        }
+        if (::bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), len) < 0) fail("bind " + address);
+        if (::listen(listen_fd, 4) < 0) fail("listen");
+    }
+
+    void close_all() {
+        for (int* fd : {&left_fd, &right_fd, &listen_fd}) {
+            if (*fd >= 0) ::close(*fd);
+            *fd = -1;
+        }
+        if (!unix_path.empty()) ::unlink(unix_path.c_str());
+    }
+
+    // the neighbour may not be listening yet, so retry for a while
+    static int connect_to(const std::string& address) {
+        sockaddr_storage addr;
+        socklen_t len;
+        int family = make_addr(address, addr, len);
+        for (int attempt = 0; attempt < 2000; ++attempt) {
+            int fd = ::socket(family, SOCK_STREAM, 0);
+            if (fd < 0) fail("socket");
+            if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), len) == 0) return fd;
+            ::close(fd);
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+        fail("connect " + address);
+    }
+
+    // send `out` to the right neighbour while receiving `in` from the left one
+    void duplex(const char* out, size_t out_n, char* in, size_t in_n) {
+        size_t sent = 0, received = 0;
+        while (sent < out_n || received < in_n) {
+            pollfd fds[2];
+            int nfds = 0;
+            if (sent < out_n) fds[nfds++] = {right_fd, POLLOUT, 0};
+            if (received < in_n) fds[nfds++] = {left_fd, POLLIN, 0};
+            if (::poll(fds, nfds, -1) < 0) {
+                if (errno == EINTR) continue;
+                fail("poll");
+            }
+            if (sent < out_n) {
+                ssize_t w = ::send(right_fd, out + sent, out_n - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+                if (w > 0) {
+                    sent += w;
+                    bytes_sent += w;
+                } else if (w < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    fail("send");
+                }
+            }
+            if (received < in_n) {
+                ssize_t r = ::recv(left_fd, in + received, in_n - received, MSG_DONTWAIT);
+                if (r == 0) throw std::runtime_error("Communicator: peer closed connection");
+                if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) fail("recv");
+                if (r > 0) received += r;
+            }
+        }
+    }
+
+    // busbw factor: bytes each link carries per payload byte
+    void record(std::chrono::steady_clock::time_point start, size_t n, double link_factor) {
+        last.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        last.bytes = (double)n * sizeof(float);
+        last.algbw = last.seconds > 0 ? last.bytes / last.seconds / 1e9 : 0;
+        last.busbw = last.algbw * link_factor;
+    }
+
+    // rs reduce-scatter steps followed by ag all-gather steps. the
+    // reduce-scatter leaves rank r owning segment r+shift+1, which is where
+    // the all-gather starts
+    void ring(float* buf, const std::vector<size_t>& offsets, int rs, int ag, int shift) {
+        int steps = rs + ag;
+        auto seg_begin = [&](int s) { return offsets[s]; };
+        auto seg_size = [&](int s) { return offsets[s + 1] - offsets[s]; };
+        auto mod = [&](int x) { return ((x % world) + world) % world; };
+        // segment sent / received at step t; what is sent at t was received at t-1
+        auto send_seg = [&](int t) { return t < rs ? mod(rank + shift - t) : mod(rank + shift + 1 - (t - rs)); };
+        auto recv_seg = [&](int t) { return t < rs ? mod(rank + shift - t - 1) : mod(rank + shift - (t - rs)); };
+
+        scratch.resize(chunk_floats);
+        int st = 0, rt = 0;            // current send / receive step
+        size_t sent = 0;               // bytes of the current send segment on the wire
+        size_t received = 0;           // bytes of the current receive segment processed
+        size_t pending = 0;            // bytes of the current chunk sitting in scratch
+
+        while (st < steps || rt < steps) {
+            // skip empty segments (n < world)
+            if (st < steps && sent == seg_size(send_seg(st)) * sizeof(float) && (st == 0 || rt > st - 1)) {
+                ++st;
+                sent = 0;
+                continue;
+            }
+            if (rt < steps && received == seg_size(recv_seg(rt)) * sizeof(float)) {
+                ++rt;
+                received = 0;
+                continue;
+            }
+
+            size_t seg_bytes = st < steps ? seg_size(send_seg(st)) * sizeof(float) : 0;
+            size_t ready = st == 0 ? seg_bytes : (rt > st - 1 ? seg_bytes : received);
+            bool want_send = st < steps && ready > sent;
+            bool want_recv = rt < steps;
+
+            pollfd fds[2];
+            int nfds = 0;
+            if (want_send) fds[nfds++] = {right_fd, POLLOUT, 0};
+            if (want_recv) fds[nfds++] = {left_fd, POLLIN, 0};
+            if (::poll(fds, nfds, -1) < 0) {
+                if (errno == EINTR) continue;
+                fail("poll");
+            }
+            for (int k = 0; k < nfds; ++k) {
+                if (fds[k].revents & (POLLERR | POLLNVAL)) throw std::runtime_error("Communicator: peer socket error");
+            }
+
+            if (want_send) {
+                const char* src = reinterpret_cast<const char*>(buf + seg_begin(send_seg(st)));
+                ssize_t w = ::send(right_fd, src + sent, ready - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+                if (w > 0) {
+                    sent += w;
+                    bytes_sent += w;
+                } else if (w < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    fail("send");
+                }
+            }
+
+            if (want_recv) {
+                size_t recv_bytes = seg_size(recv_seg(rt)) * sizeof(float);
+                size_t chunk = std::min(chunk_floats * sizeof(float), recv_bytes - received);
+                ssize_t r = ::recv(left_fd, reinterpret_cast<char*>(scratch.data()) + pending, chunk - pending, MSG_DONTWAIT);
+                if (r == 0) throw std::runtime_error("Communicator: peer closed connection");
+                if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) fail("recv");
+                if (r > 0) pending += r;
+                if (pending == chunk) {
+                    float* dst = buf + seg_begin(recv_seg(rt)) + received / sizeof(float);
+                    size_t count = chunk / sizeof(float);
+                    if (rt < rs) {
+                        for (size_t i = 0; i < count; ++i) dst[i] += scratch[i];
+                    } else {
+                        std::memcpy(dst, scratch.data(), chunk);
+                    }
+                    received += chunk;
+                    pending = 0;
+                }
+            }
+        }
+    }
+};
+
+// parameters grouped into buckets, last layer first. backward() runs the
+// graph in dependency (kahn) order instead of depth-first order, so a whole
+// layer finishes for every sample before the previous layer starts, and calls
+// on_ready(bucket) the moment no remaining node can touch that bucket's grads
+class GradBuckets {
+public:
+    std::vector<std::vector<std::shared_ptr<Value>>> buckets;
+    std::function<void(int)> on_ready;
+
+    static GradBuckets by_layer(MLP& model) {
+        GradBuckets out;
+        for (auto it = model.layers.rbegin(); it != model.layers.rend(); ++it) {
+            out.buckets.push_back((*it)->parameters());
+        }
+        return out;
+    }
+
+    void backward(std::shared_ptr<Value> root, float seed = 1) {
+        std::unordered_map<Value*, int> bucket_of;
+        std::vector<int> outstanding(buckets.size());
+        for (int b = 0; b < buckets.size(); ++b) {
+            for (auto& p : buckets[b]) {
+                bucket_of[p.get()] = b;
+            }
+            outstanding[b] = (int)buckets[b].size();
+        }
+
+        std::vector<Value*> nodes{root.get()};
+        std::unordered_map<Value*, int> waiting{{root.get(), 0}};
+        for (int i = 0; i < nodes.size(); ++i) {
+            for (auto& child : nodes[i]->_prev) {
+                auto it = waiting.find(child.get());
+                if (it == waiting.end()) {
+                    waiting.emplace(child.get(), 1);
+                    nodes.push_back(child.get());
+                } else {
+                    it->second++;
+                }
+            }
+        }
+
+        auto param_final = [&](Value* v) {
+            auto it = bucket_of.find(v);
+            if (it != bucket_of.end() && --outstanding[it->second] == 0 && on_ready) {
+                on_ready(it->second);
+            }
+        };
+        // parameters the graph never uses are final from the start
+        for (int b = 0; b < buckets.size(); ++b) {
+            for (auto& p : buckets[b]) {
+                if (!waiting.count(p.get())) param_final(p.get());
+            }
+        }
+
+        root->grad = seed;
+        std::deque<Value*> ready{root.get()};
+        while (!ready.empty()) {
+            Value* v = ready.front();
+            ready.pop_front();
+            v->_backward();
+            for (auto& child : v->_prev) {
+                if (--waiting[child.get()] == 0) {
+                    ready.push_back(child.get());
+                    param_final(child.get());
+                }
+            }
+        }
+    }
+};
+
+// local sgd: every rank trains its own replica with its own optimizer, and
+// every `period` steps the replicas are replaced by their average, cutting
+// communication by period x. with outer_momentum > 0 the averaged change
+// since the last sync is applied through a momentum buffer instead
+// (slowmo-style), which makes up for the slower mixing between replicas
+class LocalSGD {
+public:
+    Communicator& comm;
+    std::vector<std::shared_ptr<Value>> params;
+    int period;
+    float outer_momentum;
+    float outer_lr;
+    int steps = 0;
+    int syncs = 0;
+
+    // replicas must start from identical parameters
+    LocalSGD(Communicator& comm, std::vector<std::shared_ptr<Value>> params, int period, float outer_momentum=0, float outer_lr=1)
+    : comm(comm), params(params), period(period), outer_momentum(outer_momentum), outer_lr(outer_lr) {
+        gather_data(params, anchor);
+        momentum.assign(anchor.size(), 0);
+    }
+
+    // call after every local optimizer step; returns true if it synchronized
+    bool step() {
+        if (++steps % period != 0) return false;
+        gather_data(params, flat);
+        comm.allreduce(flat.data(), flat.size());
+        for (int i = 0; i < flat.size(); ++i) {
+            float average = flat[i] / comm.world;
+            if (outer_momentum == 0 && outer_lr == 1) {
+                anchor[i] = average;
+            } else {
+                momentum[i] = outer_momentum * momentum[i] + (anchor[i] - average);
+                anchor[i] -= outer_lr * momentum[i];
+            }
+        }
+        scatter_data(anchor, params);
+        ++syncs;
+        return true;
+    }
+
+private:
+    std::vector<float> anchor;      // parameters after the last sync, identical on all ranks
+    std::vector<float> momentum;
+    std::vector<float> flat;
+};
+
+// data-parallel gradient averaging overlapped with backward: as soon as a
+// bucket is final it is handed to a communication thread, which all-reduces
+// the buckets in index order (the same on every rank) while backward keeps
+// working on earlier layers
+class BucketedReducer {
+public:
+    Communicator& comm;
+    GradBuckets buckets;
+    double last_overlap = 0;   // fraction of communication time hidden behind backward
+
+    BucketedReducer(Communicator& comm, MLP& model) : comm(comm), buckets(GradBuckets::by_layer(model)), flat(buckets.buckets.size()), ready(buckets.buckets.size(), false) {
+        buckets.on_ready = [this](int b) {
+            {
+                std::lock_guard<std::mutex> lock(m);
+                ready[b] = true;
+            }
+            cv.notify_all();
+        };
+        worker = std::thread([this]() { loop(); });
+    }
+
+    ~BucketedReducer() {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            stop = true;
+        }
+        cv.notify_all();
+        worker.join();
+    }
+
+    // backward + gradient averaging across ranks; returns once all buckets are reduced
+    void backward(std::shared_ptr<Value> root, float seed = 1) {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            std::fill(ready.begin(), ready.end(), false);
+            done = 0;
+            comm_seconds = 0;
+            ++epoch;
+        }
+        cv.notify_all();
+        buckets.backward(root, seed);
+        auto backward_end = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lock(m);
+        cv.wait(lock, [this]() { return done == (int)flat.size(); });
+        double exposed = std::chrono::duration<double>(std::chrono::steady_clock::now() - backward_end).count();
+        last_overlap = comm_seconds > 0 ? std::max(0.0, 1.0 - exposed / comm_seconds) : 1.0;
+    }
+
+private:
+    std::vector<std::vector<float>> flat;
+    std::vector<bool> ready;
+    int done = 0;
+    long epoch = 0;
+    double comm_seconds = 0;
+    bool stop = false;
+    std::mutex m;
+    std::condition_variable cv;
+    std::thread worker;
+
+    void loop() {
+        long seen = 0;
+        std::unique_lock<std::mutex> lock(m);
+        while (true) {
+            cv.wait(lock, [&]() { return stop || epoch != seen; });
+            if (stop) return;
+            seen = epoch;
+            for (int b = 0; b < flat.size(); ++b) {
+                cv.wait(lock, [&]() { return stop || ready[b]; });
+                if (stop) return;
+                lock.unlock();
+                auto& params = buckets.buckets[b];
+                gather_grads(params, flat[b]);
+                comm.allreduce(flat[b].data(), flat[b].size());
+                for (auto& g : flat[b]) {
+                    g /= comm.world;
+                }
+                scatter_grads(flat[b], params);
+                lock.lock();
+                comm_seconds += comm.last.seconds;
+                done = b + 1;
+                cv.notify_all();
+            }
+        }
+    }
+};
+
+// bounded single-producer single-consumer ring; the only synchronisation is
+// one acquire/release pair per push and pop
+template <typename T>
+class SpscQueue {
+public:
+    explicit SpscQueue(size_t capacity = 64) : slots(round_up(capacity)), mask(slots.size() - 1), head(0), tail(0) {}
+
+    bool try_push(T&& v) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == slots.size()) return false;
+        slots[t & mask] = std::move(v);
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool try_pop(T& v) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) return false;
+        v = std::move(slots[h & mask]);
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    static size_t round_up(size_t n) {
+        size_t p = 1;
+        while (p < n) p <<= 1;
+        return p;
+    }
+
+    std::vector<T> slots;
+    size_t mask;
+    alignas(64) std::atomic<size_t> head;
+    alignas(64) std::atomic<size_t> tail;
+};
+
+// pipeline-parallel training step: contiguous groups of MLP layers run as
+// stages on their own threads and micro-batches stream through them. stages
+// only exchange plain floats (activations forward, input gradients backward)
+// through spsc queues, and each stage keeps the graph of a micro-batch only
+// between its forward and its backward. stage threads block on their
+// neighbours, so they are dedicated threads rather than pool tasks
+class PipelineMLP {
+public:
+    enum Schedule { GPipe, OneFOneB };
+
+    MLP& model;
+    std::vector<std::pair<int, int>> stages;    // [first, last) layer of each stage
+    Schedule schedule = OneFOneB;
+    double last_bubble = 0;     // fraction of stage time spent waiting in the last step
+
+    // split the layers into `nstages` contiguous groups of roughly equal parameter count
+    PipelineMLP(MLP& model, int nstages) : model(model) {
+        int nlayers = (int)model.layers.size();
+        nstages = std::max(1, std::min(nstages, nlayers));
+        size_t total = model.parameters().size();
+        int first = 0;
+        size_t acc = 0;
+        for (int l = 0; l < nlayers; ++l) {
+            acc += model.layers[l]->parameters().size();
+            int left_layers = nlayers - l - 1;
+            int left_stages = nstages - (int)stages.size() - 1;
+            if (left_stages == 0) continue;
+            if (acc * nstages >= total * (stages.size() + 1) || left_layers == left_stages) {
+                stages.push_back({first, l + 1});
+                first = l + 1;
+            }
+        }
+        stages.push_back({first, nlayers});
+    }
+
+    // bubble fraction of an ideal schedule with equal stage costs
+    double ideal_bubble(int micro_batches) const {
+        int s = (int)stages.size();
+        return (double)(s - 1) / (micro_batches + s - 1);
+    }
+
+    // one forward/backward over the batch with the svm loss of loss():
+    // mean of 1 + y*score. gradients accumulate into the parameters; returns the loss
+    float train_step(const std::vector<std::vector<float>>& X, const std::vector<float>& y, int micro_batch) {
+        int n = (int)X.size();
+        int nmicro = (n + micro_batch - 1) / micro_batch;
+        int nstages = (int)stages.size();
+        std::vector<std::unique_ptr<SpscQueue<Message>>> fwd, bwd;
+        for (int s = 0; s + 1 < nstages; ++s) {
+            fwd.push_back(std::make_unique<SpscQueue<Message>>(nmicro + 1));
+            bwd.push_back(std::make_unique<SpscQueue<Message>>(nmicro + 1));
+        }
+        std::vector<double> waited(nstages, 0);
+        std::vector<float> losses(nmicro, 0);
+
+        auto run_stage = [&](int s) {
+            // graph of each in-flight micro-batch: input leaves and outputs per sample
+            std::vector<std::vector<std::vector<std::shared_ptr<Value>>>> ins(nmicro), outs(nmicro);
+            std::vector<std::shared_ptr<Value>> micro_loss(nmicro);
+            bool last = s == nstages - 1;
+
+            auto receive = [&](SpscQueue<Message>& q, int micro) {
+                Message msg;
+                auto start = std::chrono::steady_clock::now();
+                while (!q.try_pop(msg)) std::this_thread::yield();
+                waited[s] += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                assert(msg.micro == micro);
+                return msg.data;
+            };
+            auto send = [&](SpscQueue<Message>& q, Message msg) {
+                while (!q.try_push(std::move(msg))) std::this_thread::yield();
+            };
+
+            auto forward = [&](int m) {
+                int lo = m * micro_batch, hi = std::min(n, lo + micro_batch);
+                std::vector<float> act;
+                if (s == 0) {
+                    for (int i = lo; i < hi; ++i) act.insert(act.end(), X[i].begin(), X[i].end());
+                } else {
+                    act = receive(*fwd[s - 1], m);
+                }
+                int width = (int)act.size() / (hi - lo);
+                Message out{m, {}};
+                for (int i = lo; i < hi; ++i) {
+                    std::vector<std::shared_ptr<Value>> x;
+                    for (int j = 0; j < width; ++j) {
+                        x.push_back(std::make_shared<Value>(act[(i - lo) * width + j]));
+                    }
+                    ins[m].push_back(x);
+                    for (int l = stages[s].first; l < stages[s].second; ++l) {
+                        x = (*model.layers[l])(x);
+                    }
+                    outs[m].push_back(x);
+                    for (auto& v : x) out.data.push_back(v->data);
+                }
+                if (last) {
+                    auto total = std::make_shared<Value>(0.0);
+                    for (int i = lo; i < hi; ++i) {
+                        auto li = Value::add(std::make_shared<Value>(1.0), Value::multiply(std::make_shared<Value>(y[i]), outs[m][i - lo][0]));
+                        total = Value::add(total, li);
+                    }
+                    micro_loss[m] = Value::multiply(total, std::make_shared<Value>(1.0f / n));
+                    losses[m] = micro_loss[m]->data;
+                } else {
+                    send(*fwd[s], std::move(out));
+                }
+            };
+
+            auto backward = [&](int m) {
+                std::shared_ptr<Value> root;
+                if (last) {
+                    root = micro_loss[m];
+                } else {
+                    // seed the stage outputs with the gradient that came back: d/dθ sum(out * g)
+                    auto g = receive(*bwd[s], m);
+                    root = std::make_shared<Value>(0.0);
+                    int k = 0;
+                    for (auto& sample : outs[m]) {
+                        for (auto& v : sample) {
+                            root = Value::add(root, Value::multiply(v, std::make_shared<Value>(g[k++])));
+                        }
+                    }
+                }
+                root->backward(root);
+                if (s > 0) {
+                    Message msg{m, {}};
+                    for (auto& sample : ins[m]) {
+                        for (auto& v : sample) msg.data.push_back(v->grad);
+                    }
+                    send(*bwd[s - 1], std::move(msg));
+                }
+                ins[m].clear();
+                outs[m].clear();
+                micro_loss[m].reset();
+            };
+
+            if (schedule == GPipe) {
+                for (int m = 0; m < nmicro; ++m) forward(m);
+                for (int m = nmicro - 1; m >= 0; --m) backward(m);
+            } else {
+                // 1f1b: warm up with as many forwards as there are later stages,
+                // then alternate, so at most nstages - s micro-batches are in flight
+                int warmup = std::min(nstages - s - 1, nmicro);
+                int f = 0, b = 0;
+                for (; f < warmup; ++f) forward(f);
+                for (; f < nmicro; ++f, ++b) {
+                    forward(f);
+                    backward(b);
+                }
+                for (; b < nmicro; ++b) backward(b);
+            }
+        };
+
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (int s = 1; s < nstages; ++s) {
+            threads.emplace_back(run_stage, s);
+        }
+        run_stage(0);
+        for (auto& t : threads) t.join();
+        double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        double idle = 0;
+        for (auto w : waited) idle += w;
+        last_bubble = wall > 0 ? std::min(1.0, idle / (wall * nstages)) : 0;
+
+        float total = 0;
+        for (auto l : losses) total += l;
+        return total;
+    }
+
+private:
+    struct Message {
+        int micro = -1;
+        std::vector<float> data;
+    };
+};
+
+// one rank's column shard of a Layer: output neurons [begin, end) and their
+// weights. activations are exchanged as neuron-major float buffers
+// (act[j * batch + b]), so every shard's slice is one contiguous segment
+class ShardedLayer {
+public:
+    Communicator& comm;
+    int nin;
+    int nout;
+    std::vector<size_t> bounds;     // neuron split, bounds[r]..bounds[r+1] belongs to rank r
+    std::shared_ptr<Layer> local;
+
+    ShardedLayer(Communicator& comm, int nin, int nout, bool nonlin=true) : comm(comm), nin(nin), nout(nout), bounds(comm.even_offsets(nout)) {
+        local = std::make_shared<Layer>(nin, (int)(bounds[comm.rank + 1] - bounds[comm.rank]), nonlin);
+    }
+
+    // shard of an existing layer, copying this rank's neurons
+    ShardedLayer(Communicator& comm, Layer& full) : ShardedLayer(comm, (int)full.neurons[0]->w.size(), (int)full.neurons.size(), full.neurons[0]->nonlin) {
+        for (int j = 0; j < local->neurons.size(); ++j) {
+            auto& src = full.neurons[bounds[comm.rank] + j];
+            for (int i = 0; i < nin; ++i) {
+                local->neurons[j]->w[i]->data = src->w[i]->data;
+            }
+            local->neurons[j]->b->data = src->b->data;
+        }
+    }
+
+    // x is replicated (neuron-major, nin x batch); returns the full output,
+    // all-gathered from the shards
+    std::vector<float> forward(const std::vector<float>& x, int batch) {
+        inputs.assign(batch, {});
+        outputs.assign(batch, {});
+        std::vector<float> out((size_t)nout * batch);
+        size_t first = bounds[comm.rank];
+        for (int b = 0; b < batch; ++b) {
+            for (int i = 0; i < nin; ++i) {
+                inputs[b].push_back(std::make_shared<Value>(x[(size_t)i * batch + b]));
+            }
+            outputs[b] = (*local)(inputs[b]);
+            for (int j = 0; j < outputs[b].size(); ++j) {
+                out[(first + j) * batch + b] = outputs[b][j]->data;
+            }
+        }
+        std::vector<size_t> offsets;
+        for (auto n : bounds) offsets.push_back(n * batch);
+        comm.allgather(out.data(), offsets);
+        return out;
+    }
+
+    // dout only needs this rank's segment. the local neurons see all inputs,
+    // so each shard holds a partial input gradient; these are summed with a
+    // reduce-scatter split like the previous layer (in_bounds), leaving each
+    // rank the slice it owns there
+    std::vector<float> backward(const std::vector<float>& dout, int batch, const std::vector<size_t>& in_bounds) {
+        size_t first = bounds[comm.rank];
+        auto root = std::make_shared<Value>(0.0);
+        for (int b = 0; b < batch; ++b) {
+            for (int j = 0; j < outputs[b].size(); ++j) {
+                root = Value::add(root, Value::multiply(outputs[b][j], std::make_shared<Value>(dout[(first + j) * batch + b])));
+            }
+        }
+        root->backward(root);
+        std::vector<float> dx((size_t)nin * batch);
+        for (int b = 0; b < batch; ++b) {
+            for (int i = 0; i < nin; ++i) {
+                dx[(size_t)i * batch + b] = inputs[b][i]->grad;
+            }
+        }
+        std::vector<size_t> offsets;
+        for (auto n : in_bounds) offsets.push_back(n * batch);
+        comm.reduce_scatter(dx.data(), offsets);
+        inputs.clear();
+        outputs.clear();
+        return dx;
+    }
+
+private:
+    std::vector<std::vector<std::shared_ptr<Value>>> inputs;
+    std::vector<std::vector<std::shared_ptr<Value>>> outputs;
+};
+
+// an MLP whose layers are all column-sharded over the ranks of comm; each
+// rank stores about 1/world of the weights. like loss(), train_step scores
+// with one output, so the last layer must have exactly one
+class ShardedMLP {
+public:
+    Communicator& comm;
+    std::vector<std::shared_ptr<ShardedLayer>> layers;
+
+    ShardedMLP(Communicator& comm, int nin, std::vector<int> nouts) : comm(comm) {
+        for (int i = 0; i < nouts.size(); ++i) {
+            layers.push_back(std::make_shared<ShardedLayer>(comm, i == 0 ? nin : nouts[i - 1], nouts[i], i != nouts.size() - 1));
+        }
+        check_single_output();
+    }
+
+    ShardedMLP(Communicator& comm, MLP& full) : comm(comm) {
+        for (auto& layer : full.layers) {
+            layers.push_back(std::make_shared<ShardedLayer>(comm, *layer));
+        }
+        check_single_output();
+    }
+
+    std::vector<std::shared_ptr<Value>> parameters() {
+        std::vector<std::shared_ptr<Value>> out;
+        for (auto& layer : layers) {
+            for (auto& p : layer->local->parameters()) {
+                out.push_back(p);
+            }
+        }
+        return out;
+    }
+
+    // one forward/backward with the svm loss of loss() (mean of 1 + y*score),
+    // X is sample-major; gradients accumulate into this rank's shard
+    float train_step(const std::vector<std::vector<float>>& X, const std::vector<float>& y) {
+        int batch = (int)X.size();
+        int nin = layers[0]->nin;
+        std::vector<float> act((size_t)nin * batch);
+        for (int b = 0; b < batch; ++b) {
+            for (int i = 0; i < nin; ++i) act[(size_t)i * batch + b] = X[b][i];
+        }
+        for (auto& layer : layers) {
+            act = layer->forward(act, batch);
+        }
+        // the scores are replicated, so every rank computes the same loss and dscore
+        float total = 0;
+        std::vector<float> grad(batch);
+        for (int b = 0; b < batch; ++b) {
+            total += (1 + y[b] * act[b]) / batch;
+            grad[b] = y[b] / batch;
+        }
+        for (int l = (int)layers.size() - 1; l >= 0; --l) {
+            auto in_bounds = l > 0 ? layers[l - 1]->bounds : comm.even_offsets(layers[0]->nin);
+            grad = layers[l]->backward(grad, batch, in_bounds);
+        }
+        return total;
+    }
+
+private:
+    void check_single_output() const {
+        if (layers.empty() || layers.back()->nout != 1) {
+            throw std::invalid_argument("ShardedMLP: the last layer must have one output");
+        }
+    }
+};
+
+// asynchronous parameter server in a posix shared-memory segment. the
+// segment holds a seqlock-versioned copy of the flat parameters, and one
+// spsc ring of gradient messages per worker. workers pull() a consistent
+// snapshot and push() the gradient computed from it; the server process
+// drains the rings, drops gradients older than max_staleness versions and
+// applies the rest with its optimizer, publishing a new version each time
+class ShmParamServer {
+public:
+    struct Stats {
+        uint64_t applied = 0;
+        uint64_t dropped = 0;   // too stale
+    };
+
+    // server side: create (and on destruction unlink) the segment
+    static std::unique_ptr<ShmParamServer> create(const std::string& name, uint32_t nparams, uint32_t nworkers, uint32_t slots = 8, uint32_t max_staleness = 4) {
+        std::unique_ptr<ShmParamServer> ps(new ShmParamServer());
+        ps->name = name;
+        ps->owner = true;
+        int fd = ::shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0) fail("shm_open " + name);
+        size_t bytes = layout_size(nparams, nworkers, slots);
+        if (::ftruncate(fd, bytes) < 0) fail("ftruncate");
+        ps->map(fd, bytes);
+        Header* h = ps->header;
+        new (h) Header();
+        h->nparams = nparams;
+        h->nworkers = nworkers;
+        h->slots = slots;
+        h->max_staleness = max_staleness;
+        for (uint32_t w = 0; w < nworkers; ++w) {
+            new (ps->ring(w)) Ring();
+        }
+        h->magic.store(kMagic, std::memory_order_release);
+        return ps;
+    }
+
+    // worker side
+    static std::unique_ptr<ShmParamServer> attach(const std::string& name) {
+        std::unique_ptr<ShmParamServer> ps(new ShmParamServer());
+        ps->name = name;
+        int fd = -1;
+        for (int attempt = 0; attempt < 2000 && fd < 0; ++attempt) {
+            fd = ::shm_open(name.c_str(), O_RDWR, 0600);
+            if (fd < 0) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        if (fd < 0) fail("shm_open " + name);
+        struct stat st;
+        if (::fstat(fd, &st) < 0) fail("fstat");
+        ps->map(fd, st.st_size);
+        while (ps->header->magic.load(std::memory_order_acquire) != kMagic) std::this_thread::yield();
+        return ps;
+    }
+
+    ~ShmParamServer() {
+        if (base) ::munmap(base, bytes);
+        if (owner) ::shm_unlink(name.c_str());
+    }
+
+    uint32_t nparams() const { return header->nparams; }
+    uint64_t version() const { return header->version.load(std::memory_order_acquire); }
+    Stats stats() const { return {header->applied.load(), header->dropped.load()}; }
+
+    // server: write a new parameter version (single writer)
+    void publish(const std::vector<float>& flat) {
+        assert(flat.size() == header->nparams);
+        uint64_t seq = header->seq.load(std::memory_order_relaxed);
+        header->seq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        std::memcpy(params(), flat.data(), flat.size() * sizeof(float));
+        header->version.fetch_add(1, std::memory_order_relaxed);
+        header->seq.store(seq + 2, std::memory_order_release);
+    }
+
+    // worker: consistent copy of the latest parameters; returns their version
+    uint64_t pull(std::vector<float>& flat) const {
+        flat.resize(header->nparams);
+        while (true) {
+            uint64_t s1 = header->seq.load(std::memory_order_acquire);
+            if (s1 & 1) {
+                std::this_thread::yield();
+                continue;
+            }
+            uint64_t v = header->version.load(std::memory_order_relaxed);
+            std::memcpy(flat.data(), params(), flat.size() * sizeof(float));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (header->seq.load(std::memory_order_relaxed) == s1) return v;
+        }
+    }
+
+    // worker: queue a gradient computed against parameter version `version`
+    void push(uint32_t worker, const std::vector<float>& grad, uint64_t version) {
+        assert(worker < header->nworkers && grad.size() == header->nparams);
+        Ring* r = ring(worker);
+        uint64_t t = r->tail.load(std::memory_order_relaxed);
+        while (t - r->head.load(std::memory_order_acquire) == header->slots) std::this_thread::yield();
+        Slot* s = slot(r, t);
+        s->version = version;
+        std::memcpy(s->grad, grad.data(), grad.size() * sizeof(float));
+        r->tail.store(t + 1, std::memory_order_release);
+    }
+
+    // server: hand every queued gradient that is fresh enough to apply(grad),
+    // publishing the parameters returned by it; returns messages consumed
+    int serve(const std::function<void(const float* grad, std::vector<float>& params)>& apply, std::vector<float>& flat) {
+        int consumed = 0;
+        for (uint32_t w = 0; w < header->nworkers; ++w) {
+            Ring* r = ring(w);
+            uint64_t h = r->head.load(std::memory_order_relaxed);
+            while (h != r->tail.load(std::memory_order_acquire)) {
+                Slot* s = slot(r, h);
+                if (version() - s->version > header->max_staleness) {
+                    header->dropped.fetch_add(1, std::memory_order_relaxed);
+                } else {
+                    apply(s->grad, flat);
+                    publish(flat);
+                    header->applied.fetch_add(1, std::memory_order_relaxed);
+                }
+                r->head.store(++h, std::memory_order_release);
+                ++consumed;
+            }
+        }
+        return consumed;
+    }
+
+private:
+    static constexpr uint64_t kMagic = 0x5053564c41564d4dull;
+
+    // atomics in the segment must be address-free to work across processes
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared-memory atomics need lock-free uint64");
+
+    struct Header {
+        std::atomic<uint64_t> magic{0};
+        uint32_t nparams = 0;
+        uint32_t nworkers = 0;
+        uint32_t slots = 0;
+        uint32_t max_staleness = 0;
+        alignas(64) std::atomic<uint64_t> seq{0};
+        std::atomic<uint64_t> version{0};
+        std::atomic<uint64_t> applied{0};
+        std::atomic<uint64_t> dropped{0};
+    };
+
+    struct Ring {
+        alignas(64) std::atomic<uint64_t> head{0};
+        alignas(64) std::atomic<uint64_t> tail{0};
+    };
+
+    struct Slot {
+        uint64_t version;
+        float grad[1];  // nparams floats
+    };
+
+    std::string name;
+    bool owner = false;
+    void* base = nullptr;
+    size_t bytes = 0;
+    Header* header = nullptr;
+
+    ShmParamServer() = default;
+
+    [[noreturn]] static void fail(const std::string& what) {
+        throw std::runtime_error("ShmParamServer: " + what + ": " + std::strerror(errno));
+    }
+
+    static size_t align64(size_t n) { return (n + 63) & ~size_t(63); }
+    static size_t params_bytes(uint32_t nparams) { return align64(nparams * sizeof(float)); }
+    static size_t slot_bytes(uint32_t nparams) { return align64(offsetof(Slot, grad) + nparams * sizeof(float)); }
+    static size_t ring_bytes(uint32_t nparams, uint32_t slots) { return align64(sizeof(Ring)) + slots * slot_bytes(nparams); }
+
+    static size_t layout_size(uint32_t nparams, uint32_t nworkers, uint32_t slots) {
+        return align64(sizeof(Header)) + params_bytes(nparams) + nworkers * ring_bytes(nparams, slots);
+    }
+
+    void map(int fd, size_t size) {
+        bytes = size;
+        base = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (base == MAP_FAILED) {
+            base = nullptr;
+            fail("mmap");
+        }
+        header = static_cast<Header*>(base);
+    }
+
+    float* params() const {
+        return reinterpret_cast<float*>(static_cast<char*>(base) + align64(sizeof(Header)));
+    }
+
+    Ring* ring(uint32_t w) const {
+        char* p = static_cast<char*>(base) + align64(sizeof(Header)) + params_bytes(header->nparams);
+        return reinterpret_cast<Ring*>(p + w * ring_bytes(header->nparams, header->slots));
+    }
+
+    Slot* slot(Ring* r, uint64_t i) const {
+        char* p = reinterpret_cast<char*>(r) + align64(sizeof(Ring));
+        return reinterpret_cast<Slot*>(p + (i % header->slots) * slot_bytes(header->nparams));
+    }
+};
+
+// columnar dataset file: a 64-byte header, a table of 64-byte column entries
+// (name + offset), then one 64-byte aligned float array per column. a
+// MappedDataset mmaps the file and hands out batches as pointers into the
+// mapping, so opening is instant and serving a batch allocates nothing
+struct DatasetHeader {
+    char magic[8];          // "VALDSET\0"
+    uint32_t version;
+    uint32_t ncols;
+    uint64_t nrows;
+    char reserved[40];
+};
+
+struct DatasetColumn {
+    char name[56];
+    uint64_t offset;        // byte offset of the column's nrows floats
+};
+
+static_assert(sizeof(DatasetHeader) == 64 && sizeof(DatasetColumn) == 64, "dataset layout is fixed");
+
+// writes a dataset of known size through a writable mapping; disjoint row
+// ranges may be filled from different threads
+class DatasetWriter {
+public:
+    DatasetWriter(const std::string& path, const std::vector<std::string>& names, uint64_t nrows) : nrows(nrows), ncols((uint32_t)names.size()) {
+        size_t offset = align64(sizeof(DatasetHeader) + ncols * sizeof(DatasetColumn));
+        std::vector<DatasetColumn> table(ncols);
+        for (uint32_t c = 0; c < ncols; ++c) {
+            std::memset(&table[c], 0, sizeof(DatasetColumn));
+            std::strncpy(table[c].name, names[c].c_str(), sizeof(table[c].name) - 1);
+            table[c].offset = offset;
+            offset = align64(offset + nrows * sizeof(float));
+        }
+        bytes = std::max<size_t>(offset, 1);
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) fail("open " + path);
+        if (::ftruncate(fd, bytes) < 0) {
+            int err = errno;
+            ::close(fd);
+            errno = err;
+            fail("ftruncate");
+        }
+        void* p = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        int err = errno;
+        ::close(fd);
+        errno = err;
+        if (p == MAP_FAILED) fail("mmap");
+        base = static_cast<char*>(p);
+        DatasetHeader header{};
+        std::memcpy(header.magic, "VALDSET", 8);
+        header.version = 1;
+        header.ncols = ncols;
+        header.nrows = nrows;
+        std::memcpy(base, &header, sizeof(header));
+        std::memcpy(base + sizeof(header), table.data(), table.size() * sizeof(DatasetColumn));
+        for (uint32_t c = 0; c < ncols; ++c) {
+            columns.push_back(reinterpret_cast<float*>(base + table[c].offset));
+        }
+    }
+
+    ~DatasetWriter() {
+        if (base) {
+            ::msync(base, bytes, MS_SYNC);
+            ::munmap(base, bytes);
+        }
+    }
+
+    DatasetWriter(const DatasetWriter&) = delete;
+    DatasetWriter& operator=(const DatasetWriter&) = delete;
+
+    // rows is row-major, count x ncols
+    void write_rows(uint64_t begin, const float* rows, size_t count) {
+        assert(begin + count <= nrows);
+        for (size_t r = 0; r < count; ++r) {
+            for (uint32_t c = 0; c < ncols; ++c) {
+                columns[c][begin + r] = rows[r * ncols + c];
+            }
+        }
+    }
+
+    float* column(uint32_t c) {
+        return columns[c];
+    }
+
+    uint64_t nrows;
+    uint32_t ncols;
+
+private:
+    char* base = nullptr;
+    size_t bytes = 0;
+    std::vector<float*> columns;
+
+    static size_t align64(size_t n) { return (n + 63) & ~size_t(63); }
+
+    [[noreturn]] static void fail(const std::string& what) {
+        throw std::runtime_error("DatasetWriter: " + what + ": " + std::strerror(errno));
+    }
+};
+
+class MappedDataset {
+public:
+    // a view of rows [begin, begin + rows): one pointer per column into the mapping
+    struct Batch {
+        uint64_t begin = 0;
+        size_t rows = 0;
+        std::vector<const float*> cols;
+
+        const float* col(int c) const { return cols[c]; }
+    };
+
+    explicit MappedDataset(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) fail("open " + path);
+        struct stat st;
+        if (::fstat(fd, &st) < 0) {
+            int err = errno;
+            ::close(fd);
+            errno = err;
+            fail("fstat");
+        }
+        size_t size = st.st_size;
+        if (size < sizeof(DatasetHeader)) {
+            ::close(fd);
+            throw std::runtime_error("MappedDataset: " + path + " is too small");
+        }
+        void* p = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        int err = errno;
+        ::close(fd);
+        errno = err;
+        if (p == MAP_FAILED) fail("mmap");
+        base = static_cast<const char*>(p);
+        bytes = size;
+        // the destructor will not run if we throw from here
+        auto reject = [&](const std::string& why) {
+            ::munmap(const_cast<char*>(base), bytes);
+            base = nullptr;
+            return std::runtime_error("MappedDataset: " + path + why);
+        };
+        std::memcpy(&header, base, sizeof(header));
+        if (std::memcmp(header.magic, "VALDSET", 8) != 0 || header.version != 1) {
+            throw reject(" is not a dataset file");
+        }
+        if ((bytes - sizeof(DatasetHeader)) / sizeof(DatasetColumn) < header.ncols) {
+            throw reject(" is truncated");
+        }
+        auto* table = reinterpret_cast<const DatasetColumn*>(base + sizeof(DatasetHeader));
+        for (uint32_t c = 0; c < header.ncols; ++c) {
+            if (table[c].offset > bytes || (bytes - table[c].offset) / sizeof(float) < header.nrows) {
+                throw reject(" is truncated");
+            }
+            names.push_back(std::string(table[c].name, strnlen(table[c].name, sizeof(table[c].name))));
+            columns.push_back(reinterpret_cast<const float*>(base + table[c].offset));
+        }
+        // batches are read front to back
+        ::madvise(const_cast<char*>(base), bytes, MADV_SEQUENTIAL);
+    }
+
+    ~MappedDataset() {
+        if (base) ::munmap(const_cast<char*>(base), bytes);
+    }
+
+    MappedDataset(const MappedDataset&) = delete;
+    MappedDataset& operator=(const MappedDataset&) = delete;
+
+    uint64_t rows() const { return header.nrows; }
+    uint32_t cols() const { return header.ncols; }
+
+    int column_index(const std::string& name) const {
+        for (int c = 0; c < names.size(); ++c) {
+            if (names[c] == name) return c;
+        }
+        return -1;
+    }
+
+    const float* column(int c) const {
+        return columns[c];
+    }
+
+    Batch batch(uint64_t begin, size_t size) const {
+        Batch b;
+        b.begin = begin;
+        b.rows = (size_t)std::min<uint64_t>(size, header.nrows - std::min(begin, header.nrows));
+        for (auto* c : columns) {
+            b.cols.push_back(c + begin);
+        }
+        return b;
+    }
+
+    // leaf Values for one column of a batch, e.g. the X and y of loss();
+    // the autograd graph needs its own nodes, the batch itself does not
+    static std::vector<std::shared_ptr<Value>> values(const Batch& b, int c) {
+        std::vector<std::shared_ptr<Value>> out;
+        out.reserve(b.rows);
+        for (size_t r = 0; r < b.rows; ++r) {
+            out.push_back(std::make_shared<Value>(b.cols[c][r]));
+        }
+        return out;
+    }
+
+    std::vector<std::string> names;
+
+private:
+    const char* base = nullptr;
+    size_t bytes = 0;
+    DatasetHeader header;
+    std::vector<const float*> columns;
+
+    [[noreturn]] static void fail(const std::string& what) {
+        throw std::runtime_error("MappedDataset: " + what + ": " + std::strerror(errno));
+    }
+};
+
+// byte scanning helpers for the csv reader: 16 (sse2) or 32 (avx2) bytes per
+// compare, scalar tail
+inline const char* find_byte(const char* p, const char* end, char c) {
+#if defined(__AVX2__)
+    __m256i needle = _mm256_set1_epi8(c);
+    for (; p + 32 <= end; p += 32) {
+        int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)), needle));
+        if (mask) return p + __builtin_ctz(mask);
+    }
+#elif defined(__SSE2__)
+    __m128i needle = _mm_set1_epi8(c);
+    for (; p + 16 <= end; p += 16) {
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)), needle));
+        if (mask) return p + __builtin_ctz(mask);
+    }
+#endif
+    for (; p < end; ++p) {
+        if (*p == c) return p;
+    }
+    return end;
+}
+
+inline size_t count_byte(const char* p, const char* end, char c) {
+    size_t n = 0;
+#if defined(__AVX2__)
+    __m256i needle = _mm256_set1_epi8(c);
+    for (; p + 32 <= end; p += 32) {
+        n += __builtin_popcount((unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)), needle)));
+    }
+#elif defined(__SSE2__)
+    __m128i needle = _mm_set1_epi8(c);
+    for (; p + 16 <= end; p += 16) {
+        n += __builtin_popcount((unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)), needle)));
+    }
+#endif
+    for (; p < end; ++p) {
+        n += *p == c;
+    }
+    return n;
+}
+
+// decimal -> float. clinger's fast path covers the usual csv number: a
+// significand below 2^24 and a power of ten up to 10 are both exact floats,
+// so one correctly rounded multiply or divide gives the correctly rounded
+// result. anything longer goes to std::from_chars. returns the end of the
+// number, or p if there is none
+inline const char* parse_float(const char* p, const char* end, float& out) {
+    static const float pow10[] = {1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f};
+    const char* q = p;
+    bool negative = q < end && *q == '-';
+    if (negative) ++q;
+    uint32_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    const char* start = q;
+    for (; q < end && (unsigned)(*q - '0') < 10 && digits < 9; ++q, ++digits) {
+        mantissa = mantissa * 10 + (*q - '0');
+    }
+    if (q < end && *q == '.') {
+        for (++q; q < end && (unsigned)(*q - '0') < 10 && digits < 9; ++q, ++digits, --exponent) {
+            mantissa = mantissa * 10 + (*q - '0');
+        }
+    }
+    bool plain = digits > 0 && q - start > (q > start && q[-1] == '.' ? 1 : 0);
+    if (plain && q < end && (*q == 'e' || *q == 'E')) {
+        const char* e = q + 1;
+        bool eneg = e < end && *e == '-';
+        if (e < end && (*e == '-' || *e == '+')) ++e;
+        int ev = 0, ed = 0;
+        for (; e < end && (unsigned)(*e - '0') < 10 && ed < 4; ++e, ++ed) ev = ev * 10 + (*e - '0');
+        if (ed == 0) plain = false;
+        exponent += eneg ? -ev : ev;
+        q = e;
+    }
+    // more digits, or anything unusual, is left to the general algorithm
+    bool more = q < end && ((unsigned)(*q - '0') < 10 || *q == '.' || *q == 'e' || *q == 'E');
+    if (plain && !more && mantissa < (1u << 24) && exponent >= -10 && exponent <= 10) {
+        float v = (float)mantissa;
+        v = exponent < 0 ? v / pow10[-exponent] : v * pow10[exponent];
+        out = negative ? -v : v;
+        return q;
+    }
+    auto res = std::from_chars(p, end, out);
+    return res.ec == std::errc() ? res.ptr : p;
+}
+
+// streaming reader for numeric csv / tsv files. the file is mmapped, not
+// read, so it may be larger than ram; it is cut into chunks at line
+// boundaries that are processed in parallel on the pool. line ends and
+// delimiters are found with simd scans and fields go through parse_float.
+// quoted fields are not supported; empty fields read as nan
+class CsvReader {
+public:
+    char delim;
+    bool has_header;
+    size_t chunk_bytes = 8 << 20;
+    std::vector<std::string> names;
+
+    struct Stats {
+        uint64_t rows = 0;
+        double bytes = 0;
+        double seconds = 0;
+        double gbps = 0;
+    };
+    Stats last;
+
+    CsvReader(const std::string& path, char delim=',', bool has_header=true) : delim(delim), has_header(has_header) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) fail("open " + path);
+        struct stat st;
+        if (::fstat(fd, &st) < 0) {
+            int err = errno;
+            ::close(fd);
+            errno = err;
+            fail("fstat");
+        }
+        bytes = st.st_size;
+        if (bytes > 0) {
+            void* p = ::mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+            int err = errno;
+            ::close(fd);
+            errno = err;
+            if (p == MAP_FAILED) fail("mmap");
+            base = static_cast<const char*>(p);
+            ::madvise(const_cast<char*>(base), bytes, MADV_SEQUENTIAL);
+        } else {
+            ::close(fd);
+        }
+
+        body = base;
+        const char* end = base + bytes;
+        const char* first_end = bytes ? find_byte(base, end, '\n') : end;
+        if (has_header && bytes) {
+            for (const char* p = base; p < first_end;) {
+                const char* q = find_byte(p, first_end, delim);
+                std::string name(p, q);
+                if (!name.empty() && name.back() == '\r') name.pop_back();
+                names.push_back(name);
+                p = q + 1;
+            }
+            body = std::min(end, first_end + 1);
+        } else if (bytes) {
+            ncols_hint = count_byte(base, first_end, delim) + 1;
+        }
+    }
+
+    ~CsvReader() {
+        if (base) ::munmap(const_cast<char*>(base), bytes);
+    }
+
+    CsvReader(const CsvReader&) = delete;
+    CsvReader& operator=(const CsvReader&) = delete;
+
+    size_t cols() const {
+        return has_header ? names.size() : ncols_hint;
+    }
+
+    // parse every row; emit(first_row, row_major_values, count) is called once
+    // per chunk, from pool workers, with the chunk's global first row index
+    void parse(const std::function<void(uint64_t, const float*, size_t)>& emit, ThreadPool& pool = ThreadPool::global()) {
+        auto start = std::chrono::steady_clock::now();
+        auto chunks = split();
+        // pass 1: rows per chunk, so every chunk knows where its rows go
+        std::vector<uint64_t> first(chunks.size() + 1, 0);
+        pool.parallel_for((int)chunks.size(), [&](int c) {
+            first[c + 1] = count_rows(chunks[c].first, chunks[c].second);
+        }, 1);
+        for (int c = 0; c < chunks.size(); ++c) first[c + 1] += first[c];
+        // pass 2: parse
+        size_t ncols = cols();
+        pool.parallel_for((int)chunks.size(), [&](int c) {
+            std::vector<float> rows;
+            rows.reserve((first[c + 1] - first[c]) * ncols);
+            parse_chunk(chunks[c].first, chunks[c].second, ncols, rows);
+            emit(first[c], rows.data(), rows.size() / std::max<size_t>(ncols, 1));
+            // done with these pages; lets files larger than ram stream through
+            uintptr_t lo = (reinterpret_cast<uintptr_t>(chunks[c].first) + 4095) & ~uintptr_t(4095);
+            uintptr_t hi = reinterpret_cast<uintptr_t>(chunks[c].second) & ~uintptr_t(4095);
+            if (hi > lo) ::madvise(reinterpret_cast<void*>(lo), hi - lo, MADV_DONTNEED);
+        }, 1);
+        last.rows = first.back();
+        finish(start);
+    }
+
+    // convert to the mmap dataset format
+    void to_dataset(const std::string& path, ThreadPool& pool = ThreadPool::global()) {
+        auto chunks = split();
+        uint64_t nrows = 0;
+        for (auto& c : chunks) nrows += count_rows(c.first, c.second);
+        std::vector<std::string> cols_names = names;
+        for (size_t c = cols_names.size(); c < cols(); ++c) cols_names.push_back("c" + std::to_string(c));
+        DatasetWriter writer(path, cols_names, nrows);
+        parse([&](uint64_t row, const float* values, size_t count) {
+            writer.write_rows(row, values, count);
+        }, pool);
+    }
+
+    // everything, row-major, for files that fit in memory
+    std::vector<float> read_all(ThreadPool& pool = ThreadPool::global()) {
+        std::vector<float> out;
+        std::mutex m;
+        parse([&](uint64_t row, const float* values, size_t count) {
+            std::lock_guard<std::mutex> lock(m);
+            size_t ncols = cols();
+            if (out.size() < (row + count) * ncols) out.resize((row + count) * ncols);
+            std::memcpy(out.data() + row * ncols, values, count * ncols * sizeof(float));
+        }, pool);
+        return out;
+    }
+
+private:
+    const char* base = nullptr;
+    const char* body = nullptr;
+    size_t bytes = 0;
+    size_t ncols_hint = 0;
+
+    [[noreturn]] static void fail(const std::string& what) {
+        throw std::runtime_error("CsvReader: " + what + ": " + std::strerror(errno));
+    }
+
+    void finish(std::chrono::steady_clock::time_point start) {
+        last.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        last.bytes = (double)bytes;
+        last.gbps = last.seconds > 0 ? last.bytes / last.seconds / 1e9 : 0;
+    }
+
+    // chunks of about chunk_bytes, each ending just after a newline
+    std::vector<std::pair<const char*, const char*>> split() const {
+        std::vector<std::pair<const char*, const char*>> out;
+        const char* end = base + bytes;
+        for (const char* p = body; p < end;) {
+            const char* q = p + std::min<size_t>(chunk_bytes, end - p);
+            if (q < end) {
+                q = find_byte(q, end, '\n');
+                if (q < end) ++q;
+            }
+            out.push_back({p, q});
+            p = q;
+        }
+        return out;
+    }
+
+    static bool blank(const char* p, const char* q) {
+        for (; p < q; ++p) {
+            if (*p != ' ' && *p != '\r' && *p != '\t') return false;
+        }
+        return true;
+    }
+
+    static uint64_t count_rows(const char* p, const char* end) {
+        uint64_t n = 0;
+        while (p < end) {
+            const char* q = find_byte(p, end, '\n');
+            n += !blank(p, q);
+            p = q + 1;
+        }
+        return n;
+    }
+
+    void parse_chunk(const char* p, const char* end, size_t ncols, std::vector<float>& rows) const {
+        const float nan = std::numeric_limits<float>::quiet_NaN();
+        while (p < end) {
+            const char* line_end = find_byte(p, end, '\n');
+            if (blank(p, line_end)) {
+                p = line_end + 1;
+                continue;
+            }
+            const char* q = p;
+            for (size_t c = 0; c < ncols; ++c) {
+                while (q < line_end && (*q == ' ' || (*q == '\t' && delim != '\t'))) ++q;
+                if (q < line_end && *q == '+') ++q;
+                float v = nan;
+                const char* next = parse_float(q, line_end, v);
+                if (next == q) v = nan;
+                q = next;
+                rows.push_back(v);
+                // skip to the next field
+                q = find_byte(q, line_end, delim);
+                if (q < line_end) ++q;
+            }
+            p = line_end + 1;
+        }
+    }
+};
+
+// prefetching minibatch pipeline over a MappedDataset: while the caller
+// trains on batch n, pool tasks gather, shuffle and normalize the next
+// `depth - 1` batches into a ring of preallocated (and, where allowed,
+// mlocked) buffers. every ring slot moves through free -> filling -> ready
+// -> in use -> free with atomic state changes only; a consumer whose next
+// batch is not ready helps the pool and reports the wait as stall time
+struct DataPipelineOptions {
+    int depth = 3;              // batches in flight, including the one in use
+    bool shuffle = true;        // a new seeded permutation every epoch
+    bool normalize = true;      // zero mean, unit variance per feature
+    uint64_t seed = 0;
+};
+
+class DataPipeline {
+public:
+    using Options = DataPipelineOptions;
+
+    struct Batch {
+        uint64_t index = 0;         // global batch number
+        size_t rows = 0;
+        int nfeatures = 0;
+        const float* x = nullptr;   // rows x nfeatures, row-major
+        const float* y = nullptr;   // rows
+
+        // leaf Values for loss(): one feature column, or the labels
+        std::vector<std::shared_ptr<Value>> feature_values(int f) const {
+            std::vector<std::shared_ptr<Value>> out;
+            for (size_t r = 0; r < rows; ++r) out.push_back(std::make_shared<Value>(x[r * nfeatures + f]));
+            return out;
+        }
+
+        std::vector<std::shared_ptr<Value>> label_values() const {
+            std::vector<std::shared_ptr<Value>> out;
+            for (size_t r = 0; r < rows; ++r) out.push_back(std::make_shared<Value>(y[r]));
+            return out;
+        }
+    };
+
+    struct Stats {
+        uint64_t batches = 0;
+        double stall_seconds = 0;   // consumer waiting for data
+        double fill_seconds = 0;    // producer work, summed over tasks
+        bool pinned = false;
+    };
+
+    // options are fixed for the pipeline's lifetime; the feature moments
+    // normalization uses are computed here, once
+    DataPipeline(const MappedDataset& ds, std::vector<int> features, int label, size_t batch_size, Options options=Options(), ThreadPool& pool=ThreadPool::global())
+    : ds(ds), features(features), label(label), batch_size(batch_size), opts(options), pool(pool), slots(std::max(2, options.depth)) {
+        if (batch_size == 0) throw std::runtime_error("DataPipeline: batch_size must be positive");
+        if (ds.rows() == 0) throw std::runtime_error("DataPipeline: dataset has no rows");
+        per_epoch = (ds.rows() + batch_size - 1) / batch_size;
+        for (auto& s : slots) {
+            s.x.resize(batch_size * features.size());
+            s.y.resize(batch_size);
+        }
+        // keep the ring resident; fine to skip when RLIMIT_MEMLOCK says no
+        bool pinned = true;
+        for (auto& s : slots) {
+            pinned = ::mlock(s.x.data(), s.x.size() * sizeof(float)) == 0 && pinned;
+            pinned = ::mlock(s.y.data(), s.y.size() * sizeof(float)) == 0 && pinned;
+        }
+        stats_.pinned = pinned;
+        compute_moments();
+    }
+
+    ~DataPipeline() {
+        pool.help_until([&]() { return inflight.load(std::memory_order_acquire) == 0; });
+        for (auto& s : slots) {
+            ::munlock(s.x.data(), s.x.size() * sizeof(float));
+            ::munlock(s.y.data(), s.y.size() * sizeof(float));
+        }
+    }
+
+    DataPipeline(const DataPipeline&) = delete;
+    DataPipeline& operator=(const DataPipeline&) = delete;
+
+    uint64_t batches_per_epoch() const { return per_epoch; }
+    Stats stats() const { return stats_; }
+
+    // the next batch; the previous one handed out becomes invalid
+    Batch next() {
+        if (!started) {
+            started = true;
+            for (uint64_t b = 0; b < slots.size(); ++b) schedule(b);
+        } else {
+            // hand the previous slot back and refill it with the batch depth ahead
+            Slot& prev = slots[(consumed - 1) % slots.size()];
+            prev.state.store(Free, std::memory_order_release);
+            schedule(consumed - 1 + slots.size());
+        }
+        Slot& s = slots[consumed % slots.size()];
+        if (s.state.load(std::memory_order_acquire) != Ready) {
+            auto start = std::chrono::steady_clock::now();
+            // run pending fills ourselves rather than just waiting on them
+            pool.help_until([&]() { return s.state.load(std::memory_order_acquire) == Ready; });
+            stats_.stall_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+        s.state.store(InUse, std::memory_order_relaxed);
+        Batch b;
+        b.index = consumed++;
+        b.rows = s.rows;
+        b.nfeatures = (int)features.size();
+        b.x = s.x.data();
+        b.y = s.y.data();
+        stats_.batches++;
+        stats_.fill_seconds = fill_nanos.load(std::memory_order_relaxed) / 1e9;
+        return b;
+    }
+
+private:
+    enum State { Free, Filling, Ready, InUse };
+
+    struct Slot {
+        std::atomic<int> state{Free};
+        size_t rows = 0;
+        std::vector<float> x;
+        std::vector<float> y;
+    };
+
+    const MappedDataset& ds;
+    std::vector<int> features;
+    int label;
+    size_t batch_size;
+    const Options opts;
+    ThreadPool& pool;
+    std::vector<Slot> slots;
+    uint64_t per_epoch = 0;
+    uint64_t consumed = 0;
+    bool started = false;
+    std::vector<float> mean, inv_std;
+    std::mutex perm_m;
+    std::unordered_map<uint64_t, std::shared_ptr<std::vector<uint32_t>>> perms;
+    std::atomic<int> inflight{0};
+    std::atomic<int64_t> fill_nanos{0};
+    Stats stats_;
+
+    // per-feature mean and 1/std over the whole dataset, one column per task
+    void compute_moments() {
+        mean.assign(features.size(), 0);
+        inv_std.assign(features.size(), 1);
+        if (!opts.normalize || ds.rows() == 0) return;
+        pool.parallel_for((int)features.size(), [&](int f) {
+            const float* col = ds.column(features[f]);
+            double sum = 0, sq = 0;
+            for (uint64_t r = 0; r < ds.rows(); ++r) {
+                sum += col[r];
+                sq += (double)col[r] * col[r];
+            }
+            double m = sum / ds.rows();
+            double var = std::max(0.0, sq / ds.rows() - m * m);
+            mean[f] = (float)m;
+            inv_std[f] = var > 0 ? (float)(1 / std::sqrt(var)) : 1.0f;
+        }, 1);
+    }
+
+    // the order of one epoch; built by the consumer thread once per epoch
+    std::shared_ptr<std::vector<uint32_t>> permutation(uint64_t epoch) {
+        std::lock_guard<std::mutex> lock(perm_m);
+        auto it = perms.find(epoch);
+        if (it != perms.end()) return it->second;
+        auto perm = std::make_shared<std::vector<uint32_t>>(ds.rows());
+        for (uint32_t i = 0; i < perm->size(); ++i) (*perm)[i] = i;
+        if (opts.shuffle) {
+            std::mt19937_64 rng(opts.seed * 1000003 + epoch);
+            std::shuffle(perm->begin(), perm->end(), rng);
+        }
+        perms.erase(epoch >= 2 ? epoch - 2 : UINT64_MAX);
+        perms[epoch] = perm;
+        return perm;
+    }
+
+    void schedule(uint64_t batch) {
+        Slot& s = slots[batch % slots.size()];
+        s.state.store(Filling, std::memory_order_relaxed);
+        auto perm = permutation(batch / per_epoch);
+        inflight.fetch_add(1, std::memory_order_relaxed);
+        pool.submit([this, &s, batch, perm]() {
+            auto start = std::chrono::steady_clock::now();
+            uint64_t first = (batch % per_epoch) * batch_size;
+            size_t rows = (size_t)std::min<uint64_t>(batch_size, ds.rows() - first);
+            size_t nf = features.size();
+            const float* ycol = ds.column(label);
+            for (size_t r = 0; r < rows; ++r) {
+                uint32_t src = (*perm)[first + r];
+                for (size_t f = 0; f < nf; ++f) {
+                    s.x[r * nf + f] = (ds.column(features[f])[src] - mean[f]) * inv_std[f];
+                }
+                s.y[r] = ycol[src];
+            }
+            s.rows = rows;
+            fill_nanos.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(), std::memory_order_relaxed);
+            s.state.store(Ready, std::memory_order_release);
+            inflight.fetch_sub(1, std::memory_order_release);
+        });
+    }
+};
+
+// numpy arrays read in place: a .npy file, or a stored (uncompressed) member
+// of an .npz archive, is mapped once and rows are handed out as pointers into
+// the mapping. f32 data needs no conversion at all; f16 and i8 are widened to
+// float a batch at a time, only for the rows that are asked for
+inline float half_to_float(uint16_t h) {
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t bits;
+    if (exp == 0x1f) {
+        bits = sign | 0x7f800000 | (mant << 13);
+    } else if (exp != 0) {
+        bits = sign | ((exp + 112) << 23) | (mant << 13);
+    } else if (mant == 0) {
+        bits = sign;
+    } else {
+        // subnormal half: renormalize into a float
+        int e = -1;
+        do { mant <<= 1; ++e; } while (!(mant & 0x400));
+        bits = sign | ((uint32_t)(112 - e) << 23) | ((mant & 0x3ff) << 13);
+    }
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+class NpyArray {
+public:
+    enum DType { F32, F16, I8 };
+
+    // rows [begin, begin + rows) as floats: a pointer into the mapping for
+    // aligned f32 data, otherwise converted into the batch's own storage
+    struct Batch {
+        uint64_t begin = 0;
+        size_t rows = 0;
+        size_t cols = 0;
+        const float* data = nullptr;
+        std::vector<float> storage;
+
+        float at(size_t r, size_t c) const { return data[r * cols + c]; }
+        bool copied() const { return !storage.empty(); }
+    };
+
+    static NpyArray open(const std::string& path) {
+        auto map = std::make_shared<Mapping>(path);
+        return NpyArray(map, 0, map->bytes, path);
+    }
+
+    DType dtype() const { return dtype_; }
+    const std::vector<uint64_t>& shape() const { return shape_; }
+    uint64_t rows() const { return shape_.empty() ? 1 : shape_[0]; }
+    uint64_t cols() const { return row_elems; }
+    size_t elem_size() const { return dtype_ == F32 ? 4 : dtype_ == F16 ? 2 : 1; }
+
+    Batch batch(uint64_t begin, size_t size) const {
+        Batch b;
+        b.begin = begin;
+        b.rows = (size_t)std::min<uint64_t>(size, rows() - std::min(begin, rows()));
+        b.cols = row_elems;
+        const char* src = data + begin * row_elems * elem_size();
+        if (dtype_ == F32 && reinterpret_cast<uintptr_t>(src) % alignof(float) == 0) {
+            b.data = reinterpret_cast<const float*>(src);
+            return b;
+        }
+        b.storage.resize(b.rows * b.cols);
+        convert(src, b.storage.data(), b.storage.size());
+        b.data = b.storage.data();
+        return b;
+    }
+
+    // leaf Values for one column of a batch, as MappedDataset::values
+    static std::vector<std::shared_ptr<Value>> values(const Batch& b, size_t c) {
+        std::vector<std::shared_ptr<Value>> out;
+        out.reserve(b.rows);
+        for (size_t r = 0; r < b.rows; ++r) {
+            out.push_back(std::make_shared<Value>(b.at(r, c)));
+        }
+        return out;
+    }
+
+    // initial weights for a layer from an (nout, nin) matrix and optional
+    // (nout,) bias; Values hold their data inline, so this one step copies
+    void load_into(Layer& layer, const NpyArray* bias=nullptr) const {
+        size_t nout = layer.neurons.size();
+        size_t nin = nout ? layer.neurons[0]->w.size() : 0;
+        if (rows() != nout || cols() != nin) {
+            throw std::runtime_error("NpyArray: weight shape does not match the layer");
+        }
+        if (bias && bias->rows() * bias->cols() != nout) {
+            throw std::runtime_error("NpyArray: bias shape does not match the layer");
+        }
+        auto w = batch(0, nout);
+        for (size_t o = 0; o < nout; ++o) {
+            for (size_t i = 0; i < nin; ++i) {
+                layer.neurons[o]->w[i]->data = w.at(o, i);
+            }
+        }
+        if (bias) {
+            std::vector<float> b(nout);
+            bias->convert(bias->data, b.data(), nout);
+            for (size_t o = 0; o < nout; ++o) {
+                layer.neurons[o]->b->data = b[o];
+            }
+        }
+    }
+
+private:
+    friend class NpzFile;
+
+    struct Mapping {
+        const char* base = nullptr;
+        size_t bytes = 0;
+
+        explicit Mapping(const std::string& path) {
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) throw std::runtime_error("NpyArray: open " + path + ": " + std::strerror(errno));
+            struct stat st;
+            if (::fstat(fd, &st) < 0) {
+                ::close(fd);
+                throw std::runtime_error("NpyArray: fstat " + path + ": " + std::strerror(errno));
+            }
+            bytes = st.st_size;
+            void* p = bytes ? ::mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+            ::close(fd);
+            if (p == MAP_FAILED) throw std::runtime_error("NpyArray: mmap " + path + " failed");
+            base = static_cast<const char*>(p);
+        }
+
+        ~Mapping() {
+            ::munmap(const_cast<char*>(base), bytes);
+        }
+    };
+
+    std::shared_ptr<Mapping> map;   // shared by every array of an .npz
+    const char* data = nullptr;
+    DType dtype_ = F32;
+    std::vector<uint64_t> shape_;
+    uint64_t row_elems = 1;
+
+    // parse the header of the array stored at [offset, offset + size)
+    NpyArray(std::shared_ptr<Mapping> m, size_t offset, size_t size, const std::string& what) : map(m) {
+        const char* p = map->base + offset;
+        auto bad = [&](const std::string& why) {
+            return std::runtime_error("NpyArray: " + what + ": " + why);
+        };
+        if (size < 10 || std::memcmp(p, "\x93NUMPY", 6) != 0) throw bad("not an .npy array");
+        size_t len, start;
+        if (p[6] == 1) {
+            len = (uint8_t)p[8] | (size_t)(uint8_t)p[9] << 8;
+            start = 10;
+        } else {
+            if (size < 12) throw bad("truncated header");
+            len = 0;
+            for (int i = 0; i < 4; ++i) len |= (size_t)(uint8_t)p[8 + i] << (8 * i);
+            start = 12;
+        }
+        if (start + len > size) throw bad("truncated header");
+        std::string header(p + start, len);
+
+        auto field = [&](const std::string& key) {
+            size_t at = header.find("'" + key + "'");
+            if (at == std::string::npos) throw bad("header has no " + key);
+            at = header.find(':', at);
+            if (at == std::string::npos) throw bad("header has no value for " + key);
+            ++at;
+            while (at < header.size() && header[at] == ' ') ++at;
+            return at;
+        };
+        size_t at = field("descr");
+        size_t quote = at < header.size() ? header.find('\'', at + 1) : std::string::npos;
+        if (quote == std::string::npos) throw bad("malformed descr");
+        std::string descr = header.substr(at + 1, quote - at - 1);
+        if (descr == "<f4") dtype_ = F32;
+        else if (descr == "<f2") dtype_ = F16;
+        else if (descr == "|i1" || descr == "<i1") dtype_ = I8;
+        else throw bad("unsupported dtype " + descr);
+        if (header.compare(field("fortran_order"), 4, "True") == 0) throw bad("fortran order is not supported");
+        at = field("shape");
+        size_t close = header.find(')', at);
+        if (at >= header.size() || header[at] != '(' || close == std::string::npos) throw bad("malformed shape");
+        // every product is checked, so a huge shape cannot wrap into a small size
+        auto mul = [&](uint64_t a, uint64_t b) {
+            uint64_t r;
+            if (__builtin_mul_overflow(a, b, &r)) throw bad("shape too large");
+            return r;
+        };
+        for (size_t i = at + 1; i < close;) {
+            if (std::isdigit((unsigned char)header[i])) {
+                uint64_t d = 0;
+                while (i < close && std::isdigit((unsigned char)header[i])) {
+                    uint64_t digit = header[i++] - '0';
+                    d = mul(d, 10);
+                    if (d > UINT64_MAX - digit) throw bad("shape too large");
+                    d += digit;
+                }
+                shape_.push_back(d);
+            } else {
+                ++i;
+            }
+        }
+        for (size_t d = 1; d < shape_.size(); ++d) row_elems = mul(row_elems, shape_[d]);
+        data = p + start + len;
+        if (mul(mul(rows(), row_elems), elem_size()) > size - start - len) throw bad("truncated data");
+    }
+
+    void convert(const char* src, float* out, size_t n) const {
+        if (dtype_ == F32) {
+            std::memcpy(out, src, n * sizeof(float));
+        } else if (dtype_ == F16) {
+            for (size_t i = 0; i < n; ++i) {
+                uint16_t h;
+                std::memcpy(&h, src + 2 * i, 2);
+                out[i] = half_to_float(h);
+            }
+        } else {
+            for (size_t i = 0; i < n; ++i) out[i] = (float)(int8_t)src[i];
+        }
+    }
+};
+
+// the arrays of an .npz (a zip of .npy files, as np.savez writes it). members
+// must be stored rather than deflated for the mapping to be usable in place
+class NpzFile {
+public:
+    explicit NpzFile(const std::string& path) : path(path), map(std::make_shared<NpyArray::Mapping>(path)) {
+        const char* base = map->base;
+        size_t bytes = map->bytes;
+        auto u16 = [&](size_t at) { return (uint32_t)(uint8_t)base[at] | (uint32_t)(uint8_t)base[at + 1] << 8; };
+        auto u32 = [&](size_t at) { return u16(at) | u16(at + 2) << 16; };
+        auto u64 = [&](size_t at) { return (uint64_t)u32(at) | (uint64_t)u32(at + 4) << 32; };
+        auto bad = [&](const std::string& why) {
+            return std::runtime_error("NpzFile: " + path + ": " + why);
+        };
+
+        // end of central directory record, searched back over the comment
+        if (bytes < 22) throw bad("not a zip archive");
+        size_t eocd = bytes - 22;
+        while (u32(eocd) != 0x06054b50) {
+            if (eocd == 0 || bytes - eocd > 22 + 0xffff) throw bad("not a zip archive");
+            --eocd;
+        }
+        uint64_t entries = u16(eocd + 10);
+        uint64_t dir = u32(eocd + 16);
+        if (dir == 0xffffffff && eocd >= 20 && u32(eocd - 20) == 0x07064b50) {
+            uint64_t eocd64 = u64(eocd - 12);
+            if (eocd64 > bytes || bytes - eocd64 < 56 || u32(eocd64) != 0x06064b50) throw bad("corrupt zip64 directory");
+            entries = u64(eocd64 + 32);
+            dir = u64(eocd64 + 48);
+        }
+
+        for (uint64_t e = 0; e < entries; ++e) {
+            if (dir > bytes || bytes - dir < 46 || u32(dir) != 0x02014b50) throw bad("corrupt central directory");
+            uint32_t method = u16(dir + 10);
+            uint64_t size = u32(dir + 20);
+            uint64_t local = u32(dir + 42);
+            size_t name_len = u16(dir + 28), extra_len = u16(dir + 30), comment_len = u16(dir + 32);
+            if (bytes - dir - 46 < name_len + extra_len + comment_len) throw bad("corrupt central directory");
+            std::string name(base + dir + 46, name_len);
+            // zip64 extra field carries whichever sizes overflowed 32 bits
+            size_t extra_end = dir + 46 + name_len + extra_len;
+            for (size_t x = dir + 46 + name_len; x + 4 <= extra_end;) {
+                size_t id = u16(x), len = u16(x + 2), at = x + 4;
+                if (at + len > extra_end) throw bad("corrupt extra field");
+                if (id == 0x0001) {
+                    auto field = [&]() {
+                        if (at + 8 > x + 4 + len) throw bad("corrupt zip64 field");
+                        uint64_t v = u64(at);
+                        at += 8;
+                        return v;
+                    };
+                    if (u32(dir + 24) == 0xffffffff) field();
+                    if (size == 0xffffffff) size = field();
+                    if (local == 0xffffffff) local = field();
+                }
+                x += 4 + len;
+            }
+            dir += 46 + name_len + extra_len + comment_len;
+
+            if (name.size() > 4 && name.compare(name.size() - 4, 4, ".npy") == 0) name.resize(name.size() - 4);
+            if (method != 0) {
+                compressed.push_back(name);
+                continue;
+            }
+            if (local > bytes || bytes - local < 30 || u32(local) != 0x04034b50) throw bad("corrupt local header for " + name);
+            size_t offset = local + 30 + u16(local + 26) + u16(local + 28);
+            if (offset > bytes || size > bytes - offset) throw bad("truncated member " + name);
+            members[name] = {offset, size};
+            names.push_back(name);
+        }
+    }
+
+    bool contains(const std::string& name) const { return members.count(name) != 0; }
+
+    NpyArray array(const std::string& name) const {
+        auto it = members.find(name);
+        if (it == members.end()) {
+            bool deflated = std::find(compressed.begin(), compressed.end(), name) != compressed.end();
+            throw std::runtime_error("NpzFile: " + path + ": " + name + (deflated ? " is compressed (use np.savez, not savez_compressed)" : " not found"));
+        }
+        return NpyArray(map, it->second.first, it->second.second, path + ":" + name);
+    }
+
+    std::vector<std::string> names;
+
+private:
+    std::string path;
+    std::shared_ptr<NpyArray::Mapping> map;
+    std::unordered_map<std::string, std::pair<size_t, size_t>> members;
+    std::vector<std::string> compressed;
+};
+
+// model checkpoints: a 64-byte header, a table with one entry per
+// MLP::layers element, then the weights and the SGD velocity as 64-byte
+// aligned float blobs in MLP::parameters() order. files are written to a
+// temporary name, synced and renamed into place, so a reader sees either the
+// old checkpoint or the new one
+struct CheckpointHeader {
+    char magic[8];          // "VALCKPT\0"
+    uint32_t version;
+    uint32_t nlayers;
+    uint64_t nparams;
+    uint64_t step;
+    uint64_t weights;       // byte offset of nparams floats
+    uint64_t velocity;      // byte offset of nparams floats, 0 without optimizer state
+    float lr;
+    float momentum;
+    char reserved[8];
+};
+
+struct CheckpointLayer {
+    uint32_t nin;
+    uint32_t nout;
+    uint32_t nonlin;
+    uint32_t reserved;
+    uint64_t first;         // index of the layer's first parameter
+    uint64_t count;         // nout * (nin + 1): each neuron's weights, then its bias
+};
+
+static_assert(sizeof(CheckpointHeader) == 64 && sizeof(CheckpointLayer) == 32, "checkpoint layout is fixed");
+
+// a flat copy of a model and its optimizer, as it goes to disk. capture()
+// reuses the buffers, so taking a snapshot of the same model again only copies
+struct CheckpointState {
+    std::vector<CheckpointLayer> layers;
+    std::vector<float> weights;
+    std::vector<float> velocity;
+    uint64_t step = 0;
+    float lr = 0;
+    float momentum = 0;
+
+    void capture(const MLP& model, const SGD* opt=nullptr, uint64_t step=0) {
+        this->step = step;
+        layers.resize(model.layers.size());
+        size_t n = 0;
+        for (size_t l = 0; l < model.layers.size(); ++l) {
+            auto& neurons = model.layers[l]->neurons;
+            CheckpointLayer& entry = layers[l];
+            entry = CheckpointLayer{};
+            entry.nout = (uint32_t)neurons.size();
+            entry.nin = neurons.empty() ? 0 : (uint32_t)neurons[0]->w.size();
+            entry.nonlin = !neurons.empty() && neurons[0]->nonlin;
+            entry.first = n;
+            entry.count = (uint64_t)entry.nout * (entry.nin + 1);
+            n += entry.count;
+        }
+        weights.resize(n);
+        float* out = weights.data();
+        for (auto& layer : model.layers) {
+            for (auto& neuron : layer->neurons) {
+                for (auto& w : neuron->w) *out++ = w->data;
+                *out++ = neuron->b->data;
+            }
+        }
+        if (opt) {
+            if (opt->velocity.size() != n) throw std::runtime_error("CheckpointState: optimizer does not match the model");
+            velocity.assign(opt->velocity.begin(), opt->velocity.end());
+            lr = opt->lr;
+            momentum = opt->momentum;
+        } else {
+            velocity.clear();
+            lr = momentum = 0;
+        }
+    }
+
+    void write(const std::string& path) const {
+        CheckpointHeader header{};
+        std::memcpy(header.magic, "VALCKPT", 8);
+        header.version = 1;
+        header.nlayers = (uint32_t)layers.size();
+        header.nparams = weights.size();
+        header.step = step;
+        header.weights = align64(sizeof(header) + layers.size() * sizeof(CheckpointLayer));
+        header.velocity = velocity.empty() ? 0 : align64(header.weights + weights.size() * sizeof(float));
+        header.lr = lr;
+        header.momentum = momentum;
+
+        std::string tmp = path + ".tmp";
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) fail("open " + tmp);
+        size_t at = 0;
+        auto put = [&](const void* p, size_t n) {
+            const char* c = static_cast<const char*>(p);
+            while (n > 0) {
+                ssize_t k = ::write(fd, c, n);
+                if (k < 0 && errno == EINTR) continue;
+                if (k <= 0) {
+                    ::close(fd);
+                    fail("write " + tmp);
+                }
+                c += k;
+                n -= k;
+                at += k;
+            }
+        };
+        auto pad = [&](size_t to) {
+            static const char zeros[64] = {};
+            put(zeros, to - at);
+        };
+        put(&header, sizeof(header));
+        put(layers.data(), layers.size() * sizeof(CheckpointLayer));
+        pad(header.weights);
+        put(weights.data(), weights.size() * sizeof(float));
+        if (header.velocity) {
+            pad(header.velocity);
+            put(velocity.data(), velocity.size() * sizeof(float));
+        }
+        if (::fsync(fd) < 0) {
+            ::close(fd);
+            fail("fsync " + tmp);
+        }
+        ::close(fd);
+        if (::rename(tmp.c_str(), path.c_str()) < 0) fail("rename " + tmp);
+        // make the rename itself durable
+        std::string dir = path.find('/') == std::string::npos ? "." : path.substr(0, path.rfind('/') + 1);
+        int dfd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+        if (dfd >= 0) {
+            ::fsync(dfd);
+            ::close(dfd);
+        }
+    }
+
+    static size_t align64(size_t n) { return (n + 63) & ~size_t(63); }
+
+    [[noreturn]] static void fail(const std::string& what) {
+        throw std::runtime_error("CheckpointState: " + what + ": " + std::strerror(errno));
+    }
+};
+
+inline void save_checkpoint(const std::string& path, const MLP& model, const SGD* opt=nullptr, uint64_t step=0) {
+    CheckpointState state;
+    state.capture(model, opt, step);
+    state.write(path);
+}
+
+// a checkpoint opened read-only through mmap: the weight blob is used in
+// place and its pages are shared by every process that opens the file.
+// Values keep their data inline, so building or filling a model is one copy
+// out of the mapping, split across the pool
+class Checkpoint {
+public:
+    explicit Checkpoint(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) fail("open " + path);
+        struct stat st;
+        if (::fstat(fd, &st) < 0) {
+            int err = errno;
+            ::close(fd);
+            errno = err;
+            fail("fstat");
+        }
+        size_t size = st.st_size;
+        if (size < sizeof(CheckpointHeader)) {
+            ::close(fd);
+            throw std::runtime_error("Checkpoint: " + path + " is too small");
+        }
+        void* p = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        int err = errno;
+        ::close(fd);
+        errno = err;
+        if (p == MAP_FAILED) fail("mmap");
+        base = static_cast<const char*>(p);
+        bytes = size;
+        // the destructor will not run if we throw from here
+        auto reject = [&](const std::string& why) {
+            ::munmap(const_cast<char*>(base), bytes);
+            base = nullptr;
+            return std::runtime_error("Checkpoint: " + path + why);
+        };
+        std::memcpy(&header, base, sizeof(header));
+        if (std::memcmp(header.magic, "VALCKPT", 8) != 0 || header.version != 1) {
+            throw reject(" is not a checkpoint file");
+        }
+        auto fits = [&](uint64_t offset, uint64_t n) { return offset <= bytes && n <= bytes - offset; };
+        bool truncated = header.nparams > bytes / sizeof(float)
+            || !fits(sizeof(header), (uint64_t)header.nlayers * sizeof(CheckpointLayer))
+            || !fits(header.weights, header.nparams * sizeof(float))
+            || (header.velocity && !fits(header.velocity, header.nparams * sizeof(float)));
+        if (truncated) throw reject(" is truncated");
+        auto* table = reinterpret_cast<const CheckpointLayer*>(base + sizeof(header));
+        layers.assign(table, table + header.nlayers);
+        // every layer must slice exactly its own weights out of the blob
+        for (auto& l : layers) {
+            if (l.first > header.nparams || l.count > header.nparams - l.first || l.count != (uint64_t)l.nout * (l.nin + 1)) {
+                throw reject(" has a layer outside the parameter block");
+            }
+        }
+        ::madvise(const_cast<char*>(base), bytes, MADV_WILLNEED);
+    }
+
+    ~Checkpoint() {
+        if (base) ::munmap(const_cast<char*>(base), bytes);
+    }
+
+    Checkpoint(const Checkpoint&) = delete;
+    Checkpoint& operator=(const Checkpoint&) = delete;
+
+    uint64_t nparams() const { return header.nparams; }
+    uint64_t step() const { return header.step; }
+    bool has_optimizer() const { return header.velocity != 0; }
+    float lr() const { return header.lr; }
+    float momentum() const { return header.momentum; }
+
+    const float* weights() const { return reinterpret_cast<const float*>(base + header.weights); }
+    const float* velocity() const { return has_optimizer() ? reinterpret_cast<const float*>(base + header.velocity) : nullptr; }
+
+    // a new MLP with the stored architecture and weights
+    std::shared_ptr<MLP> model(ThreadPool& pool = ThreadPool::global()) const {
+        if (layers.empty()) throw std::runtime_error("Checkpoint: no layers");
+        std::vector<int> nouts;
+        for (auto& l : layers) nouts.push_back((int)l.nout);
+        auto out = std::make_shared<MLP>((int)layers[0].nin, nouts);
+        load_into(*out, pool);
+        return out;
+    }
+
+    void load_into(MLP& model, ThreadPool& pool = ThreadPool::global()) const {
+        check(model);
+        const float* w = weights();
+        pool.parallel_for((int)layers.size(), [&](int l) {
+            const float* src = w + layers[l].first;
+            for (auto& neuron : model.layers[l]->neurons) {
+                for (auto& wi : neuron->w) wi->data = *src++;
+                neuron->b->data = *src++;
+            }
+        }, 1);
+    }
+
+    // optimizer state; params must be the same model's parameters()
+    void load_into(SGD& opt) const {
+        if (!has_optimizer()) throw std::runtime_error("Checkpoint: no optimizer state");
+        if (opt.params.size() != header.nparams) throw std::runtime_error("Checkpoint: optimizer does not match");
+        opt.velocity.assign(velocity(), velocity() + header.nparams);
+        opt.lr = header.lr;
+        opt.momentum = header.momentum;
+    }
+
+    std::vector<CheckpointLayer> layers;
+
+private:
+    const char* base = nullptr;
+    size_t bytes = 0;
+    CheckpointHeader header;
+
+    void check(const MLP& model) const {
+        bool same = model.layers.size() == layers.size();
+        for (size_t l = 0; same && l < layers.size(); ++l) {
+            auto& neurons = model.layers[l]->neurons;
+            same = neurons.size() == layers[l].nout && (neurons.empty() || neurons[0]->w.size() == layers[l].nin);
+        }
+        if (!same) throw std::runtime_error("Checkpoint: model architecture does not match");
+    }
+
+    [[noreturn]] static void fail(const std::string& what) {
+        throw std::runtime_error("Checkpoint: " + what + ": " + std::strerror(errno));
+    }
+};
+
+// checkpoints written without stalling training: save() copies the model and
+// optimizer into one of two preallocated snapshots and returns, and a
+// background thread writes that snapshot out (fsync, then atomic rename).
+// if a save arrives while another is still queued behind the one being
+// written, the queued one is replaced, since only the newest matters
+class AsyncCheckpointer {
+public:
+    struct Stats {
+        uint64_t saves = 0;
+        uint64_t written = 0;
+        uint64_t superseded = 0;    // queued snapshots replaced before being written
+        double capture_seconds = 0; // time save() held up the caller
+        double write_seconds = 0;   // background time
+    };
+
+    AsyncCheckpointer(const MLP& model, const SGD* opt=nullptr) : model(model), opt(opt) {
+        // size both snapshots up front so save() never allocates
+        for (auto& s : states) s.capture(model, opt);
+        writer = std::thread([this]() { run(); });
+    }
+
+    ~AsyncCheckpointer() {
+        {
+            std::unique_lock<std::mutex> lock(m);
+            idle.wait(lock, [&]() { return pending < 0 && writing < 0; });
+            stop = true;
+        }
+        work.notify_one();
+        writer.join();
+    }
+
+    AsyncCheckpointer(const AsyncCheckpointer&) = delete;
+    AsyncCheckpointer& operator=(const AsyncCheckpointer&) = delete;
+
+    void save(const std::string& path, uint64_t step) {
+        auto start = std::chrono::steady_clock::now();
+        int slot;
+        {
+            std::lock_guard<std::mutex> lock(m);
+            rethrow();
+            // the snapshot the writer is not busy with, even if it is queued
+            slot = writing == 0 ? 1 : writing == 1 ? 0 : (pending >= 0 ? pending : 0);
+            if (pending == slot) {
+                pending = -1;
+                stats_.superseded++;
+            }
+        }
+        states[slot].capture(model, opt, step);
+        {
+            std::lock_guard<std::mutex> lock(m);
+            pending = slot;
+            paths[slot] = path;
+            stats_.saves++;
+            stats_.capture_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+        work.notify_one();
+    }
+
+    // block until every queued snapshot is on disk
+    void wait() {
+        std::unique_lock<std::mutex> lock(m);
+        idle.wait(lock, [&]() { return pending < 0 && writing < 0; });
+        rethrow();
+    }
+
+    Stats stats() {
+        std::lock_guard<std::mutex> lock(m);
+        return stats_;
+    }
+
+private:
+    const MLP& model;
+    const SGD* opt;
+    CheckpointState states[2];
+    std::string paths[2];
+    int pending = -1;               // snapshot waiting to be written
+    int writing = -1;               // snapshot the writer owns
+    bool stop = false;
+    std::exception_ptr error;
+    std::mutex m;
+    std::condition_variable work, idle;
+    std::thread writer;
+    Stats stats_;
+
+    void rethrow() {
+        if (error) {
+            auto e = error;
+            error = nullptr;
+            std::rethrow_exception(e);
+        }
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(m);
+        while (true) {
+            work.wait(lock, [&]() { return stop || pending >= 0; });
+            if (pending < 0) return;
+            writing = pending;
+            pending = -1;
+            std::string path = paths[writing];
+            lock.unlock();
+            auto start = std::chrono::steady_clock::now();
+            std::exception_ptr failed;
+            try {
+                states[writing].write(path);
+            } catch (...) {
+                failed = std::current_exception();
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            lock.lock();
+            if (failed) error = failed;
+            else stats_.written++;
+            stats_.write_seconds += seconds;
+            writing = -1;
+            idle.notify_all();
+        }
+    }
+};
+
+// inference plans: an MLP lowered to what a forward pass actually needs.
+// each layer's weights are stored transposed (nin rows of nout outputs,
+// padded to a multiple of 8) so the inner loop is a contiguous axpy the
+// compiler vectorizes. the bias and the activation are applied in the same
+// pass, and the layers ping-pong between two workspace buffers whose size is
+// fixed at load time. InferencePlan only mmaps the file and runs it, with no
+// Value, closures or graph
+struct PlanHeader {
+    char magic[8];          // "VALPLAN\0"
+    uint32_t version;
+    uint32_t nlayers;
+    uint32_t nin;
+    uint32_t nout;
+    uint32_t max_stride;    // widest padded layer: one workspace row
+    uint32_t reserved0;
+    uint64_t bytes;         // whole file
+    char reserved[24];
+};
+
+struct PlanLayer {
+    uint32_t nin;
+    uint32_t nout;
+    uint32_t stride;        // nout rounded up to 8
+    uint32_t act;           // InferencePlan::Act
+    uint32_t src;           // buffer read: 0 is the caller's input, 1 and 2 the workspace
+    uint32_t dst;           // buffer written: 1 or 2
+    uint64_t weights;       // byte offset of nin * stride floats
+    uint64_t bias;          // byte offset of stride floats
+    uint64_t reserved;
+};
+
+static_assert(sizeof(PlanHeader) == 64 && sizeof(PlanLayer) == 48, "plan layout is fixed");
+
+class InferencePlan {
+public:
+    // Neuron applies no nonlinearity, so exported layers are Identity
+    enum Act { Identity, Relu };
+
+    static void write(const std::string& path, const MLP& model) {
+        if (model.layers.empty()) throw std::runtime_error("InferencePlan: empty model");
+        std::vector<PlanLayer> table(model.layers.size());
+        size_t offset = align64(sizeof(PlanHeader) + table.size() * sizeof(PlanLayer));
+        uint32_t max_stride = 0;
+        for (size_t l = 0; l < table.size(); ++l) {
+            auto& neurons = model.layers[l]->neurons;
+            PlanLayer& p = table[l];
+            p = PlanLayer{};
+            p.nout = (uint32_t)neurons.size();
+            p.nin = neurons.empty() ? 0 : (uint32_t)neurons[0]->w.size();
+            if (l > 0 && p.nin != table[l - 1].nout) throw std::runtime_error("InferencePlan: layer sizes do not chain");
+            p.stride = (p.nout + 7) & ~7u;
+            p.act = Identity;
+            p.src = l == 0 ? 0 : table[l - 1].dst;
+            p.dst = l % 2 == 0 ? 1 : 2;
+            p.weights = offset;
+            offset = align64(offset + (size_t)p.nin * p.stride * sizeof(float));
+            p.bias = offset;
+            offset = align64(offset + p.stride * sizeof(float));
+            max_stride = std::max(max_stride, p.stride);
+        }
+
+        std::vector<char> file(offset, 0);
+        PlanHeader header{};
+        std::memcpy(header.magic, "VALPLAN", 8);
+        header.version = 1;
+        header.nlayers = (uint32_t)table.size();
+        header.nin = table.front().nin;
+        header.nout = table.back().nout;
+        header.max_stride = max_stride;
+        header.bytes = offset;
+        std::memcpy(file.data(), &header, sizeof(header));
+        std::memcpy(file.data() + sizeof(header), table.data(), table.size() * sizeof(PlanLayer));
+        for (size_t l = 0; l < table.size(); ++l) {
+            auto& neurons = model.layers[l]->neurons;
+            float* w = reinterpret_cast<float*>(file.data() + table[l].weights);
+            float* b = reinterpret_cast<float*>(file.data() + table[l].bias);
+            for (uint32_t o = 0; o < table[l].nout; ++o) {
+                for (uint32_t i = 0; i < table[l].nin; ++i) {
+                    w[(size_t)i * table[l].stride + o] = neurons[o]->w[i]->data;
+                }
+                b[o] = neurons[o]->b->data;
+            }
+        }
+
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out.write(file.data(), file.size());
+        if (!out) throw std::runtime_error("InferencePlan: cannot write " + path);
+    }
+
+    explicit InferencePlan(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("InferencePlan: open " + path + ": " + std::strerror(errno));
+        struct stat st;
+        if (::fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(PlanHeader)) {
+            ::close(fd);
+            throw std::runtime_error("InferencePlan: " + path + " is too small");
+        }
+        bytes = st.st_size;
+        void* p = ::mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) throw std::runtime_error("InferencePlan: mmap " + path + " failed");
+        base = static_cast<const char*>(p);
+        // the destructor will not run if we throw from here
+        auto reject = [&](const std::string& why) {
+            ::munmap(const_cast<char*>(base), bytes);
+            base = nullptr;
+            return std::runtime_error("InferencePlan: " + path + why);
+        };
+        std::memcpy(&header, base, sizeof(header));
+        if (std::memcmp(header.magic, "VALPLAN", 8) != 0 || header.version != 1 || header.nlayers == 0) {
+            throw reject(" is not a plan file");
+        }
+        auto fits = [&](uint64_t offset, uint64_t n) { return offset <= bytes && n <= bytes - offset; };
+        if (header.bytes > bytes || !fits(sizeof(header), (uint64_t)header.nlayers * sizeof(PlanLayer))) {
+            throw reject(" is truncated");
+        }
+        layers = reinterpret_cast<const PlanLayer*>(base + sizeof(header));
+        // run() indexes its buffers with these, so hold the file to what write() produces
+        for (uint32_t l = 0; l < header.nlayers; ++l) {
+            const PlanLayer& p = layers[l];
+            if (!fits(p.weights, (uint64_t)p.nin * p.stride * sizeof(float)) || !fits(p.bias, (uint64_t)p.stride * sizeof(float))) {
+                throw reject(" is truncated");
+            }
+            bool chained = l == 0 ? p.nin == header.nin && p.src == 0 : p.nin == layers[l - 1].nout && p.src == layers[l - 1].dst;
+            bool buffers = (p.dst == 1 || p.dst == 2) && p.dst != p.src;
+            bool sized = p.stride >= p.nout && p.stride <= header.max_stride;
+            if (!chained || !buffers || !sized || p.act > Relu) throw reject(" has an inconsistent layer table");
+        }
+        if (layers[header.nlayers - 1].nout != header.nout) throw reject(" has an inconsistent layer table");
+    }
+
+    ~InferencePlan() {
+        if (base) ::munmap(const_cast<char*>(base), bytes);
+    }
+
+    InferencePlan(const InferencePlan&) = delete;
+    InferencePlan& operator=(const InferencePlan&) = delete;
+
+    uint32_t nin() const { return header.nin; }
+    uint32_t nout() const { return header.nout; }
+    uint32_t nlayers() const { return header.nlayers; }
+
+    // x is rows x nin, y is rows x nout, both row-major. with a pool, blocks
+    // of rows run in parallel, each in its own part of the workspace. that
+    // workspace belongs to the plan, so threads that call run() at the same
+    // time need a plan each
+    void run(const float* x, size_t rows, float* y, ThreadPool* pool=nullptr) {
+        size_t need = 2 * rows * header.max_stride;
+        if (workspace.size() < need) workspace.resize(need);
+        auto block = [&](size_t begin, size_t end) {
+            for (size_t r = begin; r < end; ++r) {
+                float* bufs[3] = {nullptr, &workspace[2 * r * header.max_stride], &workspace[(2 * r + 1) * header.max_stride]};
+                const float* in = x + r * header.nin;
+                for (uint32_t l = 0; l < header.nlayers; ++l) {
+                    const PlanLayer& p = layers[l];
+                    if (p.src != 0) in = bufs[p.src];
+                    dense(p, in, bufs[p.dst]);
+                }
+                std::memcpy(y + r * header.nout, bufs[layers[header.nlayers - 1].dst], header.nout * sizeof(float));
+            }
+        };
+        if (!pool || rows < 64) {
+            block(0, rows);
+            return;
+        }
+        int blocks = (int)((rows + 63) / 64);
+        pool->parallel_for(blocks, [&](int b) {
+            block((size_t)b * 64, std::min(rows, (size_t)(b + 1) * 64));
+        }, 1);
+    }
+
+    std::vector<float> run(const std::vector<float>& x, ThreadPool* pool=nullptr) {
+        size_t rows = x.size() / header.nin;
+        std::vector<float> y(rows * header.nout);
+        run(x.data(), rows, y.data(), pool);
+        return y;
+    }
+
+private:
+    const char* base = nullptr;
+    size_t bytes = 0;
+    PlanHeader header;
+    const PlanLayer* layers = nullptr;
+    std::vector<float> workspace;
+
+    // out = act(bias + in . W) for one row, W transposed and padded
+    void dense(const PlanLayer& p, const float* in, float* out) const {
+        const float* w = reinterpret_cast<const float*>(base + p.weights);
+        const float* b = reinterpret_cast<const float*>(base + p.bias);
+        std::memcpy(out, b, p.stride * sizeof(float));
+        for (uint32_t i = 0; i < p.nin; ++i) {
+            float xi = in[i];
+            const float* wi = w + (size_t)i * p.stride;
+            for (uint32_t o = 0; o < p.stride; ++o) out[o] += xi * wi[o];
+        }
+        if (p.act == Relu) {
+            for (uint32_t o = 0; o < p.stride; ++o) out[o] = std::max(out[o], 0.0f);
+        }
+    }
+
+    static size_t align64(size_t n) { return (n + 63) & ~size_t(63); }
+};
+
+// the graph built by add()/multiply() as a straight-line program. trace()
+// walks the graph from its roots once and lists every node in topological
+// order as one SSA value: the leaves the caller names become inputs, other
+// leaves become constants holding their current data. the list is what the
+// optimization passes and code generators below work on
+struct SsaOp {
+    enum Kind : uint8_t { Input, Const, Add, Mul };
+    Kind kind;
+    int a = -1;             // operands (value ids), for Add and Mul
+    int b = -1;
+    float value = 0;        // Const only
+};
+
+struct SsaGraph {
+    std::vector<SsaOp> ops;     // value id = index, operands always come first
+    std::vector<int> inputs;    // value id of each named input leaf
+    std::vector<int> outputs;   // value id of each root; backward starts at outputs[0]
+
+    static SsaGraph trace(const std::vector<std::shared_ptr<Value>>& roots, const std::vector<std::shared_ptr<Value>>& inputs) {
+        SsaGraph g;
+        std::unordered_map<const Value*, int> id;
+        std::unordered_map<const Value*, int> input_index;
+        for (int i = 0; i < inputs.size(); ++i) input_index.emplace(inputs[i].get(), i);
+        g.inputs.assign(inputs.size(), -1);
+
+        // iterative post-order dfs, children in argument order
+        std::vector<std::pair<const Value*, int>> stack;
+        auto visit = [&](const Value* root) {
+            if (id.count(root)) return;
+            stack.push_back({root, 0});
+            while (!stack.empty()) {
+                auto& [v, next] = stack.back();
+                if (next < v->_prev.size()) {
+                    const Value* child = v->_prev[next++].get();
+                    if (!id.count(child)) stack.push_back({child, 0});
+                    continue;
+                }
+                const Value* done = v;
+                stack.pop_back();
+                if (id.count(done)) continue;
+                SsaOp op;
+                auto in = input_index.find(done);
+                if (in != input_index.end()) {
+                    op.kind = SsaOp::Input;
+                    g.inputs[in->second] = (int)g.ops.size();
+                } else if (done->_prev.empty()) {
+                    op.kind = SsaOp::Const;
+                    op.value = done->data;
+                } else {
+                    if (done->_op != "+" && done->_op != "*") throw std::runtime_error("SsaGraph: cannot trace op '" + done->_op + "'");
+                    op.kind = done->_op == "+" ? SsaOp::Add : SsaOp::Mul;
+                    // _prev is deduplicated, so x + x has a single child
+                    op.a = id.at(done->_prev[0].get());
+                    op.b = done->_prev.size() > 1 ? id.at(done->_prev[1].get()) : op.a;
+                }
+                id.emplace(done, (int)g.ops.size());
+                g.ops.push_back(op);
+            }
+        };
+        for (auto& r : roots) {
+            visit(r.get());
+            g.outputs.push_back(id.at(r.get()));
+        }
+        // inputs the roots do not depend on still get a value
+        for (int i = 0; i < inputs.size(); ++i) {
+            if (g.inputs[i] < 0) {
+                g.inputs[i] = (int)g.ops.size();
+                g.ops.push_back(SsaOp{SsaOp::Input});
+            }
+        }
+        return g;
+    }
+};
+
+// a traced graph lowered to forward and reverse-mode instruction streams over
+// one flat register file, run by a switch loop. inputs and constants have
+// fixed registers, so one register file can be reused across runs and only
+// the inputs need writing; every other register is recycled as soon as its
+// value is dead (linear scan over both streams)
+class Program {
+public:
+    struct Instr {
+        enum Op : uint8_t { Add, Mul, Fma };   // d = a + b, d = a * b, d = a * b + c
+        Op op;
+        int d, a, b, c;
+    };
+
+    std::vector<Instr> forward_code;
+    std::vector<Instr> backward_code;
+    std::vector<float> init;        // initial register file: constants filled in
+    std::vector<int> inputs;        // register of each input
+    std::vector<int> outputs;       // register of each output
+    std::vector<int> grads;         // register of d outputs[0] / d input, -1 if it does not depend on it
+
+    static Program compile(const SsaGraph& g, bool with_backward=true) {
+        Program p;
+        int n = (int)g.ops.size();
+        std::vector<Instr> code;
+        // forward: value id i lives in virtual register i
+        for (int i = 0; i < n; ++i) {
+            const SsaOp& op = g.ops[i];
+            if (op.kind == SsaOp::Add) code.push_back({Instr::Add, i, op.a, op.b, -1});
+            if (op.kind == SsaOp::Mul) code.push_back({Instr::Mul, i, op.a, op.b, -1});
+        }
+        size_t nforward = code.size();
+        int nvirtual = n;
+        std::vector<float> constant_of(n + 1, 0);
+
+        std::vector<int> grad_of(n, -1);
+        int seed = -1;
+        if (with_backward && !g.outputs.empty()) {
+            // only values some input depends on need a gradient
+            std::vector<char> needs(n, 0);
+            for (int i = 0; i < n; ++i) {
+                const SsaOp& op = g.ops[i];
+                needs[i] = op.kind == SsaOp::Input || (op.a >= 0 && (needs[op.a] || needs[op.b]));
+            }
+            seed = nvirtual++;
+            grad_of[g.outputs[0]] = seed;
+            // SSA accumulation: the first contribution defines the gradient
+            // (an add just aliases its parent's), later ones make new values
+            auto contribute = [&](int child, int scale, int g_out) {
+                if (!needs[child]) return;
+                int prev = grad_of[child];
+                if (scale < 0 && prev < 0) {
+                    grad_of[child] = g_out;
+                    return;
+                }
+                int d = nvirtual++;
+                if (scale < 0) code.push_back({Instr::Add, d, prev, g_out, -1});
+                else if (prev < 0) code.push_back({Instr::Mul, d, scale, g_out, -1});
+                else code.push_back({Instr::Fma, d, scale, g_out, prev});
+                grad_of[child] = d;
+            };
+            for (int i = n - 1; i >= 0; --i) {
+                const SsaOp& op = g.ops[i];
+                if (grad_of[i] < 0 || !needs[i]) continue;
+                if (op.kind == SsaOp::Add) {
+                    contribute(op.a, -1, grad_of[i]);
+                    contribute(op.b, -1, grad_of[i]);
+                } else if (op.kind == SsaOp::Mul) {
+                    contribute(op.a, op.b, grad_of[i]);
+                    contribute(op.b, op.a, grad_of[i]);
+                }
+            }
+        }
+
+        // registers: fixed ones for inputs, constants and the seed, then
+        // temporaries reused once their last reader has run
+        std::vector<int> phys(nvirtual, -1);
+        int nregs = 0;
+        for (int i = 0; i < n; ++i) {
+            if (g.ops[i].kind == SsaOp::Input || g.ops[i].kind == SsaOp::Const) phys[i] = nregs++;
+        }
+        if (seed >= 0) phys[seed] = nregs++;
+        const int forever = INT32_MAX;
+        std::vector<int> last(nvirtual, -1);
+        for (int k = 0; k < code.size(); ++k) {
+            for (int r : {code[k].a, code[k].b, code[k].c}) {
+                if (r >= 0) last[r] = k;
+            }
+        }
+        for (int o : g.outputs) last[o] = forever;
+        for (int in : g.inputs) {
+            if (grad_of[in] >= 0) last[grad_of[in]] = forever;
+        }
+        std::vector<int> free_regs;
+        for (int k = 0; k < code.size(); ++k) {
+            Instr& ins = code[k];
+            for (int r : {ins.a, ins.b, ins.c}) {
+                // operands die here; the result may take their register
+                if (r >= 0 && last[r] == k && phys[r] >= 0 && !is_fixed(g, r, n, seed)) {
+                    free_regs.push_back(phys[r]);
+                    last[r] = -2;
+                }
+            }
+            if (phys[ins.d] < 0) {
+                if (free_regs.empty()) {
+                    phys[ins.d] = nregs++;
+                } else {
+                    phys[ins.d] = free_regs.back();
+                    free_regs.pop_back();
+                }
+                // a result nobody reads is dead on arrival
+                if (last[ins.d] == -1) free_regs.push_back(phys[ins.d]);
+            }
+            ins.d = phys[ins.d];
+            ins.a = phys[ins.a];
+            ins.b = phys[ins.b];
+            if (ins.c >= 0) ins.c = phys[ins.c];
+        }
+
+        p.forward_code.assign(code.begin(), code.begin() + nforward);
+        p.backward_code.assign(code.begin() + nforward, code.end());
+        p.init.assign(nregs, 0);
+        for (int i = 0; i < n; ++i) {
+            if (g.ops[i].kind == SsaOp::Const) p.init[phys[i]] = g.ops[i].value;
+        }
+        if (seed >= 0) p.init[phys[seed]] = 1;
+        for (int in : g.inputs) {
+            p.inputs.push_back(phys[in]);
+            p.grads.push_back(grad_of[in] >= 0 ? phys[grad_of[in]] : -1);
+        }
+        for (int o : g.outputs) p.outputs.push_back(phys[o]);
+        return p;
+    }
+
+    size_t registers() const { return init.size(); }
+
+    // copy the inputs' current data into the register file
+    void bind(float* regs, const std::vector<std::shared_ptr<Value>>& values) const {
+        for (int i = 0; i < inputs.size(); ++i) regs[inputs[i]] = values[i]->data;
+    }
+
+    void forward(float* regs) const { exec(forward_code, regs); }
+    void backward(float* regs) const { exec(backward_code, regs); }
+
+    float output(const float* regs, int i=0) const { return regs[outputs[i]]; }
+    float grad(const float* regs, int input) const { return grads[input] < 0 ? 0.0f : regs[grads[input]]; }
+
+    // the program's gradients added into the inputs' grad, as backward() would
+    void accumulate_grads(const float* regs, const std::vector<std::shared_ptr<Value>>& values) const {
+        for (int i = 0; i < inputs.size(); ++i) values[i]->grad += grad(regs, i);
+    }
+
+private:
+    static bool is_fixed(const SsaGraph& g, int r, int n, int seed) {
+        return r == seed || (r < n && (g.ops[r].kind == SsaOp::Input || g.ops[r].kind == SsaOp::Const));
+    }
+
+    static void exec(const std::vector<Instr>& code, float* r) {
+        for (const Instr& ins : code) {
+            switch (ins.op) {
+            case Instr::Add: r[ins.d] = r[ins.a] + r[ins.b]; break;
+            case Instr::Mul: r[ins.d] = r[ins.a] * r[ins.b]; break;
+            case Instr::Fma: r[ins.d] = r[ins.a] * r[ins.b] + r[ins.c]; break;
+            }
+        }
+    }
+};
+
+// rewrites of a traced graph. every pass keeps the inputs (in order) and the
+// outputs, and the values and input gradients a Program computes from the
+// result. loss() starts its running sums from 0 and builds one 1.0 per
+// sample; those, and anything folding exposes, are removed before either
+// sweep runs. loss()'s accuracy values are not reachable from the loss, so
+// trace() already leaves them out
+struct SsaPasses {
+    struct Stats {
+        size_t before = 0;
+        size_t after = 0;
+        size_t folded = 0;      // ops on constants replaced by their result
+        size_t simplified = 0;  // x * 1, x + 0 replaced by x
+        size_t merged = 0;      // duplicates of an existing value
+        size_t removed = 0;     // values no output depends on
+    };
+
+    // all passes until nothing changes, then dead value removal
+    static SsaGraph optimize(const SsaGraph& g, Stats* stats=nullptr) {
+        Stats s;
+        s.before = g.ops.size();
+        SsaGraph cur = g;
+        while (true) {
+            size_t changed = 0;
+            cur = fold_constants(cur, &changed);
+            s.folded += changed;
+            size_t n = changed;
+            cur = simplify(cur, &changed);
+            s.simplified += changed;
+            n += changed;
+            cur = eliminate_common(cur, &changed);
+            s.merged += changed;
+            n += changed;
+            cur = eliminate_dead(cur, &changed);
+            s.removed += changed;
+            if (n == 0) break;
+        }
+        s.after = cur.ops.size();
+        if (stats) *stats = s;
+        return cur;
+    }
+
+    static SsaGraph fold_constants(const SsaGraph& g, size_t* count=nullptr) {
+        size_t n = 0;
+        auto out = rewrite(g, [&](SsaGraph& dst, SsaOp& op) {
+            if ((op.kind == SsaOp::Add || op.kind == SsaOp::Mul) && is_const(dst, op.a) && is_const(dst, op.b)) {
+                float a = dst.ops[op.a].value, b = dst.ops[op.b].value;
+                op = SsaOp{SsaOp::Const, -1, -1, op.kind == SsaOp::Add ? a + b : a * b};
+                ++n;
+            }
+            return Keep;
+        });
+        if (count) *count = n;
+        return out;
+    }
+
+    static SsaGraph simplify(const SsaGraph& g, size_t* count=nullptr) {
+        size_t n = 0;
+        auto out = rewrite(g, [&](SsaGraph& dst, SsaOp& op) {
+            float unit = op.kind == SsaOp::Mul ? 1.0f : 0.0f;
+            if (op.kind != SsaOp::Add && op.kind != SsaOp::Mul) return Keep;
+            if (is_const(dst, op.b) && dst.ops[op.b].value == unit) {
+                ++n;
+                return op.a;
+            }
+            if (is_const(dst, op.a) && dst.ops[op.a].value == unit) {
+                ++n;
+                return op.b;
+            }
+            return Keep;
+        });
+        if (count) *count = n;
+        return out;
+    }
+
+    // constants by bit pattern, adds and muls by (op, operands) up to order
+    static SsaGraph eliminate_common(const SsaGraph& g, size_t* count=nullptr) {
+        size_t n = 0;
+        std::unordered_map<uint32_t, int> consts;
+        std::unordered_map<uint64_t, int> adds, muls;
+        auto out = rewrite(g, [&](SsaGraph& dst, SsaOp& op) {
+            int next = (int)dst.ops.size();
+            std::pair<std::unordered_map<uint64_t, int>::iterator, bool> hit;
+            if (op.kind == SsaOp::Const) {
+                uint32_t bits;
+                std::memcpy(&bits, &op.value, sizeof(bits));
+                auto c = consts.emplace(bits, next);
+                if (c.second) return Keep;
+                ++n;
+                return c.first->second;
+            }
+            if (op.kind == SsaOp::Input) return Keep;
+            uint64_t key = (uint64_t)std::min(op.a, op.b) << 32 | (uint32_t)std::max(op.a, op.b);
+            hit = (op.kind == SsaOp::Add ? adds : muls).emplace(key, next);
+            if (hit.second) return Keep;
+            ++n;
+            return hit.first->second;
+        });
+        if (count) *count = n;
+        return out;
+    }
+
+    static SsaGraph eliminate_dead(const SsaGraph& g, size_t* count=nullptr) {
+        std::vector<char> live(g.ops.size(), 0);
+        for (int o : g.outputs) live[o] = 1;
+        for (int i = (int)g.ops.size() - 1; i >= 0; --i) {
+            if (g.ops[i].kind == SsaOp::Input) live[i] = 1;
+            if (live[i] && g.ops[i].a >= 0) live[g.ops[i].a] = live[g.ops[i].b] = 1;
+        }
+        size_t n = 0;
+        int index = 0;
+        auto out = rewrite(g, [&](SsaGraph&, SsaOp&) {
+            if (live[index++]) return Keep;
+            ++n;
+            return Drop;
+        });
+        if (count) *count = n;
+        return out;
+    }
+
+private:
+    static constexpr int Keep = -1;     // append the (rewritten) op
+    static constexpr int Drop = -2;     // nothing refers to it
+
+    static bool is_const(const SsaGraph& g, int id) {
+        return g.ops[id].kind == SsaOp::Const;
+    }
+
+    // rebuild g op by op: fn sees each op with operands already renamed into
+    // the new graph and returns Keep, Drop, or the new id to use instead
+    template <typename Fn>
+    static SsaGraph rewrite(const SsaGraph& g, Fn fn) {
+        SsaGraph out;
+        std::vector<int> map(g.ops.size(), -1);
+        out.ops.reserve(g.ops.size());
+        for (int i = 0; i < g.ops.size(); ++i) {
+            SsaOp op = g.ops[i];
+            if (op.a >= 0) {
+                op.a = map[op.a];
+                op.b = map[op.b];
+            }
+            int r = fn(out, op);
+            if (r == Keep || op.kind == SsaOp::Input) {
+                map[i] = (int)out.ops.size();
+                out.ops.push_back(op);
+            } else {
+                map[i] = r == Drop ? -1 : r;
+            }
+        }
+        for (int in : g.inputs) out.inputs.push_back(map[in]);
+        for (int o : g.outputs) out.outputs.push_back(map[o]);
+        return out;
+    }
+};
+
+// a Program compiled ahead of time: its streams are emitted as straight-line
+// C++ (split into small functions: gcc's time grows quickly with function
+// size, and -O1 gets most of -O2's speed here for half the build time),
+// built into a shared library with the system compiler
+// and dlopen'd. libraries are cached by a hash of the generated source, the
+// compiler and its flags, so a network seen before loads without compiling;
+// the source is kept beside the library and must match exactly before a
+// cached library is trusted, so a hash collision only costs a rebuild.
+// the cache is per user and anything in it is loaded into the process, so
+// the directory and every library must be owned by us and writable by no
+// one else. constants stay in the register file, so one library serves
+// every set of constant values
+class CompiledProgram {
+public:
+    using Fn = void (*)(float*);
+
+    bool cached = false;        // loaded from the cache, nothing was compiled
+    std::string library;
+
+    CompiledProgram(const Program& program, const std::string& cache_dir=default_cache_dir(), const std::string& flags="-O1") {
+        std::string src = source(program);
+        const char* env = std::getenv("CXX");
+        std::string cxx = env ? env : "c++";
+        // the compiler and flags head the stored source, so they are compared too
+        src = "// " + cxx + " " + flags + "\n" + src;
+        char key[17];
+        std::snprintf(key, sizeof(key), "%016llx", (unsigned long long)fnv1a(src));
+        if (::mkdir(cache_dir.c_str(), 0700) < 0 && errno != EEXIST) fail("mkdir " + cache_dir);
+        check_private(cache_dir, true);
+        std::string stem = cache_dir + "/prog_" + key;
+        library = stem + ".so";
+        struct stat st;
+        cached = ::lstat(library.c_str(), &st) == 0 && same_source(stem + ".cpp", src);
+        if (!cached) build(src, stem, cxx, flags);
+        check_private(library, false);
+        handle = ::dlopen(library.c_str(), RTLD_NOW | RTLD_LOCAL);
+        if (!handle) throw std::runtime_error(std::string("CompiledProgram: dlopen: ") + ::dlerror());
+        forward_fn = reinterpret_cast<Fn>(::dlsym(handle, "value_forward"));
+        backward_fn = reinterpret_cast<Fn>(::dlsym(handle, "value_backward"));
+        if (!forward_fn || !backward_fn) {
+            ::dlclose(handle);
+            throw std::runtime_error("CompiledProgram: " + library + " lacks entry points");
+        }
+    }
+
+    ~CompiledProgram() {
+        if (handle) ::dlclose(handle);
+    }
+
+    CompiledProgram(const CompiledProgram&) = delete;
+    CompiledProgram& operator=(const CompiledProgram&) = delete;
+
+    // same register file layout as the Program it came from
+    void forward(float* regs) const { forward_fn(regs); }
+    void backward(float* regs) const { backward_fn(regs); }
+
+    // $VALUE_JIT_CACHE, else value_jit under $XDG_CACHE_HOME or ~/.cache
+    static std::string default_cache_dir() {
+        if (const char* dir = std::getenv("VALUE_JIT_CACHE")) return dir;
+        std::string root;
+        if (const char* xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg) {
+            root = xdg;
+        } else if (const char* home = std::getenv("HOME"); home && *home) {
+            root = std::string(home) + "/.cache";
+        } else {
+            return "/tmp/value_jit-" + std::to_string(::geteuid());
+        }
+        ::mkdir(root.c_str(), 0700);
+        return root + "/value_jit";
+    }
+
+    static std::string source(const Program& program) {
+        std::string out = "// generated from a traced Value graph\n";
+        emit(out, "value_forward", program.forward_code);
+        emit(out, "value_backward", program.backward_code);
+        return out;
+    }
+
+private:
+    void* handle = nullptr;
+    Fn forward_fn = nullptr;
+    Fn backward_fn = nullptr;
+
+    static void emit(std::string& out, const std::string& name, const std::vector<Program::Instr>& code) {
+        const size_t per_fn = 256;
+        size_t parts = (code.size() + per_fn - 1) / per_fn;
+        char line[96];
+        for (size_t p = 0; p < parts; ++p) {
+            out += "static void " + name + "_" + std::to_string(p) + "(float* r) {\n";
+            for (size_t k = p * per_fn; k < std::min(code.size(), (p + 1) * per_fn); ++k) {
+                const auto& ins = code[k];
+                if (ins.op == Program::Instr::Add) std::snprintf(line, sizeof(line), "r[%d] = r[%d] + r[%d];\n", ins.d, ins.a, ins.b);
+                if (ins.op == Program::Instr::Mul) std::snprintf(line, sizeof(line), "r[%d] = r[%d] * r[%d];\n", ins.d, ins.a, ins.b);
+                if (ins.op == Program::Instr::Fma) std::snprintf(line, sizeof(line), "r[%d] = r[%d] * r[%d] + r[%d];\n", ins.d, ins.a, ins.b, ins.c);
+                out += line;
+            }
+            out += "}\n";
+        }
+        out += "extern \"C\" void " + name + "(float* r) {\n";
+        for (size_t p = 0; p < parts; ++p) out += "    " + name + "_" + std::to_string(p) + "(r);\n";
+        out += "}\n";
+    }
+
+    // a directory (or library) someone else could have planted or can
+    // still swap out is refused rather than loaded
+    static void check_private(const std::string& path, bool dir) {
+        struct stat st;
+        if (::lstat(path.c_str(), &st) < 0) fail("lstat " + path);
+        bool kind = dir ? S_ISDIR(st.st_mode) : S_ISREG(st.st_mode);
+        bool mode = dir ? (st.st_mode & 077) == 0 : (st.st_mode & 022) == 0;
+        if (!kind || st.st_uid != ::geteuid() || !mode) {
+            throw std::runtime_error("CompiledProgram: " + path + " is not private to this user");
+        }
+    }
+
+    [[noreturn]] static void fail(const std::string& what) {
+        throw std::runtime_error("CompiledProgram: " + what + ": " + std::strerror(errno));
+    }
+
+    // the source a cached library was built from, if it is still there
+    static bool same_source(const std::string& path, const std::string& src) {
+        struct stat st;
+        if (::lstat(path.c_str(), &st) < 0 || (size_t)st.st_size != src.size()) return false;
+        check_private(path, false);
+        std::ifstream f(path, std::ios::binary);
+        std::string stored((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+        return stored == src;
+    }
+
+    static uint64_t fnv1a(const std::string& s) {
+        uint64_t h = 1469598103934665603ull;
+        for (unsigned char c : s) {
+            h ^= c;
+            h *= 1099511628211ull;
+        }
+        return h;
+    }
+
+    // compile next to the cache entry, then rename, so concurrent builders
+    // of the same program never see a half-written library
+    static void build(const std::string& src, const std::string& stem, const std::string& cxx, const std::string& flags) {
+        std::string tag = "." + std::to_string(getpid());
+        std::string cpp = stem + tag + ".cpp", so = stem + tag + ".so", log = stem + tag + ".log";
+        {
+            std::ofstream f(cpp);
+            f << src;
+            if (!f) throw std::runtime_error("CompiledProgram: cannot write " + cpp);
+        }
+        std::vector<std::string> args{cxx};
+        for (size_t at = 0; at < flags.size();) {
+            size_t end = flags.find(' ', at);
+            if (end == std::string::npos) end = flags.size();
+            if (end > at) args.push_back(flags.substr(at, end - at));
+            at = end + 1;
+        }
+        for (const char* a : {"-shared", "-fPIC", "-o"}) args.push_back(a);
+        args.push_back(so);
+        args.push_back(cpp);
+
+        std::cout.flush();
+        pid_t pid = fork();
+        if (pid == 0) {
+            int fd = ::open(log.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd >= 0) {
+                ::dup2(fd, 1);
+                ::dup2(fd, 2);
+            }
+            std::vector<char*> argv;
+            for (auto& a : args) argv.push_back(const_cast<char*>(a.c_str()));
+            argv.push_back(nullptr);
+            ::execvp(argv[0], argv.data());
+            _exit(127);
+        }
+        int status = 0;
+        if (pid < 0 || waitpid(pid, &status, 0) < 0) status = -1;
+        if (status != 0) {
+            std::remove(cpp.c_str());
+            std::ifstream f(log);
+            std::string why((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+            std::remove(log.c_str());
+            std::remove(so.c_str());
+            throw std::runtime_error("CompiledProgram: " + cxx + " failed: " + why.substr(0, 2000));
+        }
+        std::remove(log.c_str());
+        // the compiler honours umask; pin the mode so check_private accepts it.
+        // the library goes in first: a reader that sees it with the old
+        // source just rebuilds
+        bool ok = ::chmod(so.c_str(), 0700) == 0 && ::rename(so.c_str(), (stem + ".so").c_str()) == 0;
+        ok = ok && ::chmod(cpp.c_str(), 0600) == 0 && ::rename(cpp.c_str(), (stem + ".cpp").c_str()) == 0;
+        if (!ok) {
+            std::remove(so.c_str());
+            std::remove(cpp.c_str());
+            throw std::runtime_error("CompiledProgram: rename " + so + ": " + std::strerror(errno));
+        }
+    }
+};
+
+// log2-bucketed histogram of microsecond values, e.g. request latency
+struct Histogram {
+    std::array<uint64_t, 40> buckets{};     // bucket k holds [2^(k-1), 2^k) us, bucket 0 is < 1 us
+    uint64_t count = 0;
+    double sum = 0;
+    double max = 0;
+
+    void add(double us) {
+        int k = us < 1 ? 0 : std::min<int>((int)std::log2(us) + 1, (int)buckets.size() - 1);
+        buckets[k]++;
+        count++;
+        sum += us;
+        max = std::max(max, us);
+    }
+
+    double mean() const { return count ? sum / count : 0; }
+
+    // upper edge of the bucket holding the p-th quantile
+    double percentile(double p) const {
+        uint64_t rank = (uint64_t)std::ceil(p * count), seen = 0;
+        for (int k = 0; k < buckets.size(); ++k) {
+            seen += buckets[k];
+            if (seen >= std::max<uint64_t>(rank, 1)) return std::min(max, std::ldexp(1.0, k));
+        }
+        return max;
+    }
+};
+
+struct BatchingOptions {
+    size_t max_batch = 32;                          // run as soon as this many are queued
+    std::chrono::microseconds max_delay{500};       // or when the oldest has waited this long
+};
+
+// serves single-row requests from many threads with batched forwards: a
+// batcher thread takes queued requests once max_batch of them are waiting or
+// the oldest has waited max_delay, packs them into one row-major block, runs
+// the model once and completes each request. any batched forward will do;
+// an InferencePlan is the usual one. if the model throws, every request in
+// that batch fails with the exception
+class InferenceEngine {
+public:
+    using Options = BatchingOptions;
+    using Model = std::function<void(const float* x, size_t rows, float* y)>;
+    // error is null on success; otherwise y is empty
+    using Done = std::function<void(std::vector<float> y, std::exception_ptr error)>;
+
+    struct Stats {
+        uint64_t requests = 0;
+        uint64_t batches = 0;
+        uint64_t failed = 0;        // requests whose batch threw
+        double seconds = 0;         // since the engine started
+        double throughput = 0;      // requests per second
+        Histogram latency;          // submit to completion, us
+        Histogram batch_size;
+    };
+
+    InferenceEngine(Model model, size_t nin, size_t nout, Options options = Options())
+    : nin(nin), nout(nout), model(std::move(model)), opts(options), started(std::chrono::steady_clock::now()) {
+        opts.max_batch = std::max<size_t>(opts.max_batch, 1);
+        batcher = std::thread([this]() { run(); });
+    }
+
+    InferenceEngine(InferencePlan& plan, Options options = Options())
+    : InferenceEngine([&plan](const float* x, size_t rows, float* y) { plan.run(x, rows, y); }, plan.nin(), plan.nout(), options) {}
+
+    // requests already queued are still served
+    ~InferenceEngine() {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            stop = true;
+        }
+        cv.notify_all();
+        batcher.join();
+    }
+
+    InferenceEngine(const InferenceEngine&) = delete;
+    InferenceEngine& operator=(const InferenceEngine&) = delete;
+
+    std::future<std::vector<float>> submit(std::vector<float> x) {
+        auto promise = std::make_shared<std::promise<std::vector<float>>>();
+        auto future = promise->get_future();
+        submit(std::move(x), [promise](std::vector<float> y, std::exception_ptr error) {
+            if (error) {
+                promise->set_exception(error);
+            } else {
+                promise->set_value(std::move(y));
+            }
+        });
+        return future;
+    }
+
+    // done runs on the batcher thread, so it should be quick; anything it
+    // throws is dropped
+    void submit(std::vector<float> x, Done done) {
+        if (x.size() != nin) throw std::invalid_argument("InferenceEngine: request has the wrong width");
+        {
+            std::lock_guard<std::mutex> lock(m);
+            queue.push_back(Request{std::move(x), std::move(done), std::chrono::steady_clock::now()});
+        }
+        cv.notify_one();
+    }
+
+    Stats stats() {
+        std::lock_guard<std::mutex> lock(m);
+        Stats s = stats_;
+        s.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        s.throughput = s.seconds > 0 ? s.requests / s.seconds : 0;
+        return s;
+    }
+
+    size_t nin, nout;
+
+private:
+    struct Request {
+        std::vector<float> x;
+        Done done;
+        std::chrono::steady_clock::time_point arrived;
+    };
+
+    Model model;
+    Options opts;
+    std::chrono::steady_clock::time_point started;
+    std::mutex m;
+    std::condition_variable cv;
+    std::deque<Request> queue;
+    bool stop = false;
+    Stats stats_;
+    std::thread batcher;
+
+    void run() {
+        std::vector<Request> batch;
+        std::vector<float> x, y;
+        std::unique_lock<std::mutex> lock(m);
+        while (true) {
+            cv.wait(lock, [&]() { return stop || !queue.empty(); });
+            if (queue.empty()) return;
+            // hold the batch open until it fills or its oldest request is due
+            auto due = queue.front().arrived + opts.max_delay;
+            cv.wait_until(lock, due, [&]() { return stop || queue.size() >= opts.max_batch; });
+            size_t n = std::min(queue.size(), opts.max_batch);
+            batch.clear();
+            for (size_t i = 0; i < n; ++i) {
+                batch.push_back(std::move(queue.front()));
+                queue.pop_front();
+            }
+            lock.unlock();
+
+            x.resize(n * nin);
+            y.resize(n * nout);
+            for (size_t i = 0; i < n; ++i) std::memcpy(&x[i * nin], batch[i].x.data(), nin * sizeof(float));
+            std::exception_ptr error;
+            try {
+                model(x.data(), n, y.data());
+            } catch (...) {
+                error = std::current_exception();
+            }
+            auto now = std::chrono::steady_clock::now();
+
+            // counted before completing, so a caller that has its reply sees it in stats()
+            lock.lock();
+            stats_.requests += n;
+            stats_.batches++;
+            if (error) stats_.failed += n;
+            stats_.batch_size.add((double)n);
+            for (auto& r : batch) {
+                stats_.latency.add(std::chrono::duration<double, std::micro>(now - r.arrived).count());
+            }
+            lock.unlock();
+
+            for (size_t i = 0; i < n; ++i) {
+                std::vector<float> out;
+                if (!error) out.assign(y.begin() + i * nout, y.begin() + (i + 1) * nout);
+                try {
+                    batch[i].done(std::move(out), error);
+                } catch (...) {
+                }
+            }
+            lock.lock();
+        }
+    }
+};
+
+// unix-socket front end for an InferenceEngine, for local testing. a request
+// is a uint32 count followed by that many floats, the reply has the same
+// form; a request of the wrong width, or one whose batch failed, gets an
+// empty reply. one poll thread reads whatever each client has sent without
+// blocking, buffers it and hands complete requests to the engine. replies are
+// queued per client and sent without blocking, by the engine's completion
+// callback if the socket has room and by the poll thread otherwise, so a
+// client that stops reading only ever holds up itself
+class InferenceServer {
+public:
+    InferenceServer(InferenceEngine& engine, const std::string& path) : engine(engine), path(path) {
+        listen_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listen_fd < 0) fail("socket");
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path)) throw std::runtime_error("InferenceServer: socket path too long");
+        std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        ::unlink(path.c_str());
+        if (::bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) fail("bind " + path);
+        if (::listen(listen_fd, 64) < 0) fail("listen");
+        wake = std::make_shared<Wake>();
+        thread = std::thread([this]() { run(); });
+    }
+
+    ~InferenceServer() {
+        stopping.store(true);
+        wake->ring();
+        thread.join();
+        ::close(listen_fd);
+        ::unlink(path.c_str());
+    }
+
+    InferenceServer(const InferenceServer&) = delete;
+    InferenceServer& operator=(const InferenceServer&) = delete;
+
+    // one blocking round trip from a client
+    static std::vector<float> query(const std::string& path, const std::vector<float>& x) {
+        int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) fail("socket");
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+            ::close(fd);
+            fail("connect " + path);
+        }
+        std::vector<float> y;
+        bool ok = send_floats(fd, x) && recv_floats(fd, y);
+        ::close(fd);
+        if (!ok) throw std::runtime_error("InferenceServer: connection to " + path + " failed");
+        if (y.empty()) throw std::runtime_error("InferenceServer: request to " + path + " was rejected or failed");
+        return y;
+    }
+
+private:
+    // a client stops being read while this much of its output is unsent
+    static constexpr size_t kMaxPending = 1 << 20;
+
+    // wakes the poll thread, to stop or to watch a socket that has output
+    // queued. shared with the connections, since the engine's callbacks may
+    // outlive the server
+    struct Wake {
+        int fd[2] = {-1, -1};
+
+        Wake() {
+            if (::pipe(fd) < 0) fail("pipe");
+            for (int f : fd) ::fcntl(f, F_SETFL, ::fcntl(f, F_GETFL, 0) | O_NONBLOCK);
+        }
+
+        ~Wake() {
+            ::close(fd[0]);
+            ::close(fd[1]);
+        }
+
+        void ring() {
+            char c = 0;
+            (void)!::write(fd[1], &c, 1);
+        }
+
+        void clear() {
+            char buf[64];
+            while (::read(fd[0], buf, sizeof(buf)) > 0) {
+            }
+        }
+    };
+
+    // the engine's callback may outlive the poll loop's interest in a client
+    struct Conn {
+        int fd;
+        std::shared_ptr<Wake> wake;
+        std::vector<char> in;           // bytes of requests not yet complete
+        std::atomic<bool> eof{false};   // the client has stopped sending
+        std::atomic<int> inflight{0};   // requests the engine has not answered
+        std::mutex write_m;
+        std::vector<char> out;          // reply bytes not yet sent, under write_m
+        bool broken = false;            // a send failed; replies are dropped
+
+        Conn(int fd, std::shared_ptr<Wake> wake) : fd(fd), wake(std::move(wake)) {}
+        ~Conn() { ::close(fd); }
+
+        void reply(const std::vector<float>& v) {
+            std::lock_guard<std::mutex> lock(write_m);
+            if (broken) return;
+            bool idle = out.empty();
+            auto msg = frame(v);
+            out.insert(out.end(), msg.begin(), msg.end());
+            flush();
+            // the poll thread only watches for room while output is queued
+            if (idle && !out.empty()) wake->ring();
+        }
+
+        // sends what the socket takes now; caller holds write_m
+        void flush() {
+            size_t at = 0;
+            while (at < out.size()) {
+                ssize_t k = ::send(fd, out.data() + at, out.size() - at, MSG_NOSIGNAL | MSG_DONTWAIT);
+                if (k > 0) {
+                    at += k;
+                } else if (k < 0 && errno == EINTR) {
+                    continue;
+                } else if (k < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    break;
+                } else {
+                    broken = true;
+                    at = out.size();
+                }
+            }
+            out.erase(out.begin(), out.begin() + at);
+        }
+    };
+
+    InferenceEngine& engine;
+    std::string path;
+    int listen_fd = -1;
+    std::shared_ptr<Wake> wake;
+    std::atomic<bool> stopping{false};
+    std::thread thread;
+
+    void run() {
+        std::vector<std::shared_ptr<Conn>> conns;
+        while (true) {
+            std::vector<pollfd> fds{{wake->fd[0], POLLIN, 0}, {listen_fd, POLLIN, 0}};
+            std::vector<std::shared_ptr<Conn>> polled;
+            for (auto& c : conns) {
+                short events = c->eof ? 0 : POLLIN;
+                {
+                    std::lock_guard<std::mutex> lock(c->write_m);
+                    if (!c->out.empty()) events |= POLLOUT;
+                    if (c->out.size() > kMaxPending) events &= ~POLLIN;
+                }
+                if (events) {
+                    fds.push_back({c->fd, events, 0});
+                    polled.push_back(c);
+                }
+            }
+            if (::poll(fds.data(), fds.size(), -1) < 0) {
+                if (errno == EINTR) continue;
+                return;
+            }
+            if (fds[0].revents) {
+                wake->clear();
+                if (stopping.load()) return;
+            }
+            if (fds[1].revents & POLLIN) {
+                int fd = ::accept(listen_fd, nullptr, nullptr);
+                if (fd >= 0) conns.push_back(std::make_shared<Conn>(fd, wake));
+            }
+            for (size_t i = 2; i < fds.size(); ++i) {
+                auto& conn = polled[i - 2];
+                short revents = fds[i].revents;
+                if (revents & (POLLOUT | POLLERR | POLLHUP)) {
+                    std::lock_guard<std::mutex> lock(conn->write_m);
+                    conn->flush();
+                }
+                if ((fds[i].events & POLLIN) && (revents & (POLLIN | POLLERR | POLLHUP))) {
+                    if (!drain(*conn)) conn->eof = true;
+                    if (!serve(conn)) {
+                        std::lock_guard<std::mutex> lock(conn->write_m);
+                        conn->broken = true;
+                    }
+                }
+            }
+            // a client is kept until it has stopped sending and has every reply
+            std::vector<std::shared_ptr<Conn>> alive;
+            for (auto& c : conns) {
+                std::lock_guard<std::mutex> lock(c->write_m);
+                if (!c->broken && (!c->eof || c->inflight > 0 || !c->out.empty())) alive.push_back(c);
+            }
+            conns = std::move(alive);
+        }
+    }
+
+    // reads what is available without waiting, a bounded amount so one busy
+    // client cannot starve the rest; false once the client is gone
+    static bool drain(Conn& conn) {
+        char buf[4096];
+        for (int reads = 0; reads < 16;) {
+            ssize_t k = ::recv(conn.fd, buf, sizeof(buf), MSG_DONTWAIT);
+            if (k > 0) {
+                conn.in.insert(conn.in.end(), buf, buf + k);
+                ++reads;
+                continue;
+            }
+            if (k < 0 && errno == EINTR) continue;
+            return k < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        }
+        return true;
+    }
+
+    // submits every complete request in the buffer; false on a malformed one
+    bool serve(const std::shared_ptr<Conn>& conn) {
+        size_t at = 0;
+        while (conn->in.size() - at >= sizeof(uint32_t)) {
+            uint32_t n;
+            std::memcpy(&n, conn->in.data() + at, sizeof(n));
+            if (n > (1u << 24)) return false;
+            size_t len = sizeof(n) + n * sizeof(float);
+            if (conn->in.size() - at < len) break;
+            std::vector<float> x(n);
+            std::memcpy(x.data(), conn->in.data() + at + sizeof(n), n * sizeof(float));
+            at += len;
+            if (n != engine.nin) {
+                conn->reply({});
+                continue;
+            }
+            conn->inflight++;
+            engine.submit(std::move(x), [conn](std::vector<float> y, std::exception_ptr) {
+                conn->reply(y);
+                // a client that already hung up is only dropped once answered
+                if (conn->inflight.fetch_sub(1) == 1 && conn->eof) conn->wake->ring();
+            });
+        }
+        conn->in.erase(conn->in.begin(), conn->in.begin() + at);
+        return true;
+    }
+
+    static std::vector<char> frame(const std::vector<float>& v) {
+        uint32_t n = (uint32_t)v.size();
+        std::vector<char> msg(sizeof(n) + n * sizeof(float));
+        std::memcpy(msg.data(), &n, sizeof(n));
+        std::memcpy(msg.data() + sizeof(n), v.data(), n * sizeof(float));
+        return msg;
+    }
+
+    static bool send_floats(int fd, const std::vector<float>& v) {
+        auto msg = frame(v);
+        for (size_t at = 0; at < msg.size();) {
+            ssize_t k = ::send(fd, msg.data() + at, msg.size() - at, MSG_NOSIGNAL);
+            if (k < 0 && errno == EINTR) continue;
+            if (k <= 0) return false;
+            at += k;
+        }
+        return true;
+    }
+
+    static bool recv_all(int fd, void* p, size_t n) {
+        char* c = static_cast<char*>(p);
+        while (n > 0) {
+            ssize_t k = ::recv(fd, c, n, MSG_WAITALL);
+            if (k < 0 && errno == EINTR) continue;
+            if (k <= 0) return false;
+            c += k;
+            n -= k;
+        }
+        return true;
+    }
+
+    static bool recv_floats(int fd, std::vector<float>& v) {
+        uint32_t n;
+        if (!recv_all(fd, &n, sizeof(n)) || n > (1u << 24)) return false;
+        v.resize(n);
+        return recv_all(fd, v.data(), n * sizeof(float));
+    }
+
+    [[noreturn]] static void fail(const std::string& what) {
+        throw std::runtime_error("InferenceServer: " + what + ": " + std::strerror(errno));
+    }
+};
+
+// test grad calculation
+void test_grad() {
+    auto a = std::make_shared<Value>(1.0);
+    auto b = std::make_shared<Value>(2.0);
+    auto c = std::make_shared<Value>(3.0);
+    auto d = std::make_shared<Value>(4.0);
+
+    auto e = Value::add(a, b);
+    auto f = Value::multiply(c, d);
+    auto g = Value::add(e, f);
+
+    g->backward(g);
+
+    assert(a->grad == 1);
+    assert(b->grad == 1);
+    assert(c->grad == 4);
+    assert(d->grad == 3);
+
+    std::cout << "Passed: test_grad" << std::endl;
+}
 
 void test_num_params() {
     auto mlp = MLP(2, {16, 16, 1});
@@ -220,89 +5280,1691 @@ void test_num_params() {
     std::cout << "Passed: test_num_params" << std::endl;
 }
 
-void test_mlp() {
-    auto mlp = MLP(2, {3, 1});
-    auto x = std::vector<std::shared_ptr<Value>>{std::make_shared<Value>(1.0), std::make_shared<Value>(2.0)};
-    auto y = mlp(x);
-    y[0]->backward(y[0]); 
+void test_mlp() {
+    auto mlp = MLP(2, {3, 1});
+    auto x = std::vector<std::shared_ptr<Value>>{std::make_shared<Value>(1.0), std::make_shared<Value>(2.0)};
+    auto y = mlp(x);
+    y[0]->backward(y[0]); 
+}
+
+void test_backward_parallel() {
+    auto model = MLP(4, {32, 32, 1});
+    auto x = std::vector<std::shared_ptr<Value>>{std::make_shared<Value>(0.5), std::make_shared<Value>(-1.0), std::make_shared<Value>(2.0), std::make_shared<Value>(0.25)};
+    auto y = model(x);
+    y[0]->backward(y[0]);
+    std::vector<float> expected;
+    for (auto& p : model.parameters()) {
+        expected.push_back(p->grad);
+    }
+
+    model.zero_grad();
+    ThreadPool pool(4);
+    y = model(x);
+    y[0]->backward_parallel(y[0], pool);
+    auto params = model.parameters();
+    for (int i = 0; i < params.size(); ++i) {
+        assert(std::abs(params[i]->grad - expected[i]) <= 1e-4f * std::max(1.0f, std::abs(expected[i])));
+    }
+
+    // a seed scales every gradient, as it does for backward()
+    model.zero_grad();
+    y = model(x);
+    y[0]->backward_parallel(y[0], pool, 0.25f);
+    for (int i = 0; i < params.size(); ++i) {
+        assert(std::abs(params[i]->grad - 0.25f * expected[i]) <= 1e-4f * std::max(1.0f, std::abs(expected[i])));
+    }
+    std::cout << "Passed: test_backward_parallel" << std::endl;
+}
+
+// WIP 
+std::shared_ptr<Value> loss(std::vector<std::shared_ptr<Value>> X, std::vector<std::shared_ptr<Value>> y, std::shared_ptr<MLP> model, int batch_size, ThreadPool* pool = nullptr, TapeSet* tapes = nullptr) {
+
+    std::vector<std::vector<std::shared_ptr<Value>>> inputs;
+    for (auto& xrow : X) {
+        std::vector<std::shared_ptr<Value>> row;
+        row.push_back(xrow);
+        inputs.push_back(row);
+    }
+    // print 
+    std::cout << "Inputs: " << std::endl;
+    for (auto& input : inputs) {
+        std::cout << input[0]->data << std::endl;
+    }
+
+    // forward the model to get scores
+    std::vector<std::shared_ptr<Value>> scores;
+    if (tapes) {
+        // every sample records its own tape; backward through tapes->backward()
+        tapes->main.clear();
+        tapes->samples.clear();
+        scores.resize(inputs.size());
+        for (int i = 0; i < inputs.size(); ++i) {
+            tapes->samples.push_back(std::make_unique<Tape>());
+        }
+        auto forward_sample = [&](int i) {
+            Tape::Scope scope(*tapes->samples[i]);
+            scores[i] = model->operator()(inputs[i])[0];
+        };
+        if (pool) {
+            pool->parallel_for((int)inputs.size(), forward_sample, 1);
+        } else {
+            for (int i = 0; i < inputs.size(); ++i) {
+                forward_sample(i);
+            }
+        }
+    } else if (pool) {
+        // samples are independent, forward them concurrently
+        scores.resize(inputs.size());
+        pool->parallel_for((int)inputs.size(), [&](int i) {
+            scores[i] = model->forward_parallel(inputs[i], *pool)[0];
+        });
+    } else {
+        for (auto& input : inputs) {
+            scores.push_back(model->operator()(input)[0]);
+        }
+    }
+    // print scores
+    std::cout << "Scores: " << std::endl;
+    for (auto& score : scores) {
+        std::cout << score->data << std::endl;
+    }
+
+    std::unique_ptr<Tape::Scope> main_scope;
+    if (tapes) {
+        main_scope = std::make_unique<Tape::Scope>(tapes->main);
+    }
+
+    // svm "max-margin" loss
+    std::vector<std::shared_ptr<Value>> losses;
+    for (int i = 0; i < y.size(); ++i) {
+        losses.push_back(Value::add(std::make_shared<Value>(1.0), Value::multiply(y[i], scores[i])));
+    }
+    std::shared_ptr<Value> data_loss = std::make_shared<Value>(0.0);
+    for (auto& lossi : losses) {
+        data_loss = Value::add(data_loss, lossi);
+    }
+    data_loss = Value::multiply(data_loss, std::make_shared<Value>(1.0 / losses.size()));
+    // L2 regularization
+    float alpha = 1e-4;
+    std::shared_ptr<Value> reg_loss = std::make_shared<Value>(0.0);
+    for (auto& p : model->parameters()) {
+        reg_loss = Value::add(reg_loss, Value::multiply(p, p));
+    }
+    reg_loss = Value::multiply(reg_loss, std::make_shared<Value>(alpha));
+    std::shared_ptr<Value> total_loss = Value::add(data_loss, reg_loss);
+
+    // also get accuracy
+    std::vector<std::shared_ptr<Value>> accuracy;
+    for (int i = 0; i < y.size(); ++i) {
+        accuracy.push_back(Value::add(std::make_shared<Value>(y[i]->data > 0), std::make_shared<Value>(scores[i]->data > 0)));
+    }
+    std::shared_ptr<Value> acc = std::make_shared<Value>(0.0);
+    for (auto& acci : accuracy) {
+        acc = Value::add(acc, acci);
+    }
+    acc = Value::multiply(acc, std::make_shared<Value>(1.0 / accuracy.size()));
+    
+    return total_loss;
+}
+
+void test_loss() {
+    auto mlp = MLP(2, {16, 16, 1});
+    auto x = std::vector<std::shared_ptr<Value>>{std::make_shared<Value>(1.0), std::make_shared<Value>(2.0)};
+    auto y = std::vector<std::shared_ptr<Value>>{std::make_shared<Value>(1.0)};
+    auto l = loss(x, y, std::make_shared<MLP>(mlp), -1);
+    l->backward(l);
+    // print loss
+    std::cout << l->data << std::endl;
+    std::cout << "Passed: test_loss" << std::endl;
+}
+
+void test_forward_parallel() {
+    auto model = std::make_shared<MLP>(2, std::vector<int>{16, 16, 1});
+    auto X = std::vector<std::shared_ptr<Value>>{std::make_shared<Value>(1.0), std::make_shared<Value>(-2.0), std::make_shared<Value>(0.5)};
+    auto y = std::vector<std::shared_ptr<Value>>{std::make_shared<Value>(1.0), std::make_shared<Value>(-1.0), std::make_shared<Value>(1.0)};
+    auto expected = loss(X, y, model, -1);
+    expected->backward(expected);
+    std::vector<float> grads;
+    for (auto& p : model->parameters()) {
+        grads.push_back(p->grad);
+    }
+
+    model->zero_grad();
+    ThreadPool pool(4);
+    auto l = loss(X, y, model, -1, &pool);
+    assert(l->data == expected->data);
+    l->backward(l);
+    auto params = model->parameters();
+    for (int i = 0; i < params.size(); ++i) {
+        assert(params[i]->grad == grads[i]);
+    }
+
+    // nodes built on the workers and freed here go back to the workers'
+    // heaps, so repeated steps stop carving new slabs. a worker that takes a
+    // bigger share of some later step may still carve one or two; freed
+    // blocks piling up on this thread instead would cost a slab every step
+    auto step = [&]() {
+        auto l = loss(X, y, model, -1, &pool);
+        l->backward(l);
+    };
+    auto* out = std::cout.rdbuf(nullptr);
+    for (int i = 0; i < 50; ++i) step();
+    size_t slabs = NodeArena::slabs();
+    for (int i = 0; i < 500; ++i) step();
+    std::cout.rdbuf(out);
+    assert(NodeArena::slabs() - slabs < 16);
+    std::cout << "Passed: test_forward_parallel" << std::endl;
+}
+void test_thread_pool() {
+    ThreadPool::Options opts;
+    opts.threads = 3;
+    opts.pin = true;
+    opts.spin = 100;
+    ThreadPool pool(opts);
+    std::vector<int> hits(10000, 0);
+    pool.parallel_for((int)hits.size(), [&](int i) { hits[i]++; }, 64);
+    for (auto h : hits) {
+        assert(h == 1);
+    }
+
+    // nested regions and tasks spawned from workers (exercises pop/steal races and deque growth)
+    std::atomic<int> total(0);
+    pool.parallel_for(8, [&](int) {
+        pool.parallel_for(1000, [&](int) { total.fetch_add(1); }, 1);
+    }, 1);
+    assert(total.load() == 8000);
+
+    // parked workers must wake up for later work
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    std::atomic<int> after(0);
+    pool.parallel_for(100, [&](int) { after.fetch_add(1); }, 1);
+    assert(after.load() == 100);
+
+    // an exception from fn reaches the caller only after every helper is done
+    std::atomic<int> ran(0);
+    bool threw = false;
+    try {
+        pool.parallel_for(1000, [&](int i) {
+            ran.fetch_add(1);
+            if (i == 10) throw std::runtime_error("fn");
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }, 1);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    int seen = ran.load();
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    assert(threw && ran.load() == seen && seen < 1000);
+
+    auto model = MLP(2, {8, 1});
+    SGD opt(model.parameters(), 0.1f, 0.9f);
+    for (auto& p : model.parameters()) {
+        p->grad = 1;
+    }
+    opt.step(pool);
+    opt.step(pool);
+    // weights start at 1 and biases at 0; two momentum steps move each by -(0.1 + 0.19)
+    for (auto& p : model.layers[0]->neurons[0]->w) {
+        assert(std::abs(p->data - 0.71f) < 1e-6f);
+    }
+    assert(std::abs(model.layers[1]->neurons[0]->b->data + 0.29f) < 1e-6f);
+
+    // tasks left in a worker's deque at shutdown are freed with the pool
+    auto token = std::make_shared<int>(0);
+    std::atomic<bool> spawned(false);
+    {
+        ThreadPool small(1);
+        small.submit([&]() {
+            for (int i = 0; i < 1000; ++i) {
+                small.submit([token]() {});
+            }
+            spawned = true;
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        });
+        while (!spawned) std::this_thread::yield();
+    }
+    assert(token.use_count() == 1);
+    std::cout << "Passed: test_thread_pool" << std::endl;
+}
+void test_tapes_deterministic() {
+    auto model = std::make_shared<MLP>(1, std::vector<int>{8, 8, 1});
+    std::vector<std::shared_ptr<Value>> X, y;
+    for (int i = 0; i < 16; ++i) {
+        X.push_back(std::make_shared<Value>(0.1f * i - 0.7f));
+        y.push_back(std::make_shared<Value>(i % 3 ? 1.0f : -1.0f));
+    }
+    auto l = loss(X, y, model, -1);
+    l->backward(l);
+    std::vector<float> serial;
+    for (auto& p : model->parameters()) {
+        serial.push_back(p->grad);
+    }
+
+    std::vector<std::vector<float>> runs;
+    for (int threads : {1, 2, 4}) {
+        model->zero_grad();
+        ThreadPool pool(threads);
+        TapeSet tapes;
+        auto lt = loss(X, y, model, -1, &pool, &tapes);
+        assert(lt->data == l->data);
+        tapes.backward(lt, pool);
+        std::vector<float> grads;
+        for (auto& p : model->parameters()) {
+            grads.push_back(p->grad);
+        }
+        runs.push_back(grads);
+    }
+    for (int i = 0; i < serial.size(); ++i) {
+        assert(runs[0][i] == runs[1][i] && runs[1][i] == runs[2][i]);
+        assert(std::abs(runs[0][i] - serial[i]) <= 1e-4f * std::max(1.0f, std::abs(serial[i])));
+    }
+    std::cout << "Passed: test_tapes_deterministic" << std::endl;
+}
+void test_grad_accumulation() {
+    std::vector<std::shared_ptr<Value>> X, y;
+    for (int i = 0; i < 16; ++i) {
+        X.push_back(std::make_shared<Value>(0.1f * i - 0.7f));
+        y.push_back(std::make_shared<Value>(i % 3 ? 1.0f : -1.0f));
+    }
+
+    auto full = std::make_shared<MLP>(1, std::vector<int>{8, 1});
+    SGD full_opt(full->parameters(), 0.01f);
+    auto l = loss(X, y, full, -1);
+    l->backward(l);
+    full_opt.step();
+
+    auto micro = std::make_shared<MLP>(1, std::vector<int>{8, 1});
+    SGD micro_opt(micro->parameters(), 0.01f);
+    GradAccumulator accumulator(micro_opt, 4);
+    for (int k = 0; k < 4; ++k) {
+        std::vector<std::shared_ptr<Value>> xb(X.begin() + 4 * k, X.begin() + 4 * k + 4);
+        std::vector<std::shared_ptr<Value>> yb(y.begin() + 4 * k, y.begin() + 4 * k + 4);
+        auto lb = loss(xb, yb, micro, -1);
+        std::weak_ptr<Value> graph = lb;
+        bool stepped = accumulator.backward(lb);
+        assert(stepped == (k == 3));
+        // nothing but the parameters and inputs survives a micro-batch
+        assert(graph.expired());
+    }
+
+    auto p_full = full->parameters();
+    auto p_micro = micro->parameters();
+    for (int i = 0; i < p_full.size(); ++i) {
+        assert(std::abs(p_full[i]->data - p_micro[i]->data) < 1e-5f);
+        assert(p_micro[i]->grad == 0);
+    }
+    std::cout << "Passed: test_grad_accumulation" << std::endl;
+}
+// fork one child per rank and check that every one of them exits cleanly.
+// children leave with _exit: the pool threads of the parent do not exist in them
+bool run_ranks(int world, const std::function<void(int)>& fn) {
+    std::cout.flush();
+    std::vector<pid_t> pids;
+    for (int r = 0; r < world; ++r) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            try {
+                fn(r);
+            } catch (const std::exception& e) {
+                std::cerr << "rank " << r << ": " << e.what() << std::endl;
+                _exit(1);
+            }
+            std::cout.flush();
+            _exit(0);
+        }
+        pids.push_back(pid);
+    }
+    bool ok = true;
+    for (auto pid : pids) {
+        int status = 0;
+        waitpid(pid, &status, 0);
+        ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    return ok;
+}
+
+void test_ring_allreduce() {
+    std::string prefix = "/tmp/value_ring_" + std::to_string(getpid());
+    for (int world : {2, 3, 4}) {
+        bool ok = run_ranks(world, [&](int rank) {
+            Communicator comm(rank, world, Communicator::unix_addresses(prefix, world));
+            comm.chunk_floats = 1000;
+            // small integers, so the sum is exact in any reduction order
+            for (size_t n : {(size_t)1, (size_t)3, (size_t)100003}) {
+                std::vector<float> buf(n);
+                for (size_t i = 0; i < n; ++i) buf[i] = (float)((rank + 1) * (i % 97));
+                comm.allreduce(buf.data(), n);
+                for (size_t i = 0; i < n; ++i) {
+                    assert(buf[i] == (float)(world * (world + 1) / 2 * (i % 97)));
+                }
+            }
+            if (rank == 0 && world == 4) {
+                std::cout << "ring allreduce " << comm.last.bytes / 1e6 << " MB, busbw " << comm.last.busbw << " GB/s" << std::endl;
+            }
+
+            // data parallel: each replica saw different data, grads end up averaged
+            auto model = MLP(2, {4, 1});
+            auto params = model.parameters();
+            for (auto& p : params) p->grad = (float)rank;
+            comm.allreduce_grads(params);
+            for (auto& p : params) assert(p->grad == (float)(world - 1) / 2);
+        });
+        assert(ok);
+    }
+
+    // same ring over loopback tcp
+    int base_port = 20000 + getpid() % 20000;
+    bool ok = run_ranks(3, [&](int rank) {
+        Communicator comm(rank, 3, Communicator::tcp_addresses("127.0.0.1", base_port, 3));
+        std::vector<float> buf(50000, 1.0f);
+        comm.allreduce(buf.data(), buf.size());
+        for (auto v : buf) assert(v == 3.0f);
+    });
+    assert(ok);
+
+    // a constructor that fails after listening leaves no fd or socket behind;
+    // the lowest free descriptor is the same before and after
+    int before = ::dup(0);
+    ::close(before);
+    bool threw = false;
+    try {
+        Communicator comm(0, 2, {"unix:" + prefix + ".bad", "nowhere"});
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    int after = ::dup(0);
+    ::close(after);
+    assert(threw && after == before && ::access((prefix + ".bad").c_str(), F_OK) < 0);
+    std::cout << "Passed: test_ring_allreduce" << std::endl;
 }
+void test_bucketed_reduce() {
+    std::vector<std::shared_ptr<Value>> X, y;
+    for (int i = 0; i < 4; ++i) {
+        X.push_back(std::make_shared<Value>(0.3f * i - 0.5f));
+        y.push_back(std::make_shared<Value>(i % 2 ? 1.0f : -1.0f));
+    }
 
-// WIP 
-std::shared_ptr<Value> loss(std::vector<std::shared_ptr<Value>> X, std::vector<std::shared_ptr<Value>> y, std::shared_ptr<MLP> model, int batch_size) {
+    // buckets become final last layer first, and grads match plain backward
+    auto model = std::make_shared<MLP>(1, std::vector<int>{6, 6, 1});
+    auto l = loss(X, y, model, -1);
+    l->backward(l);
+    std::vector<float> expected;
+    gather_grads(model->parameters(), expected);
+    model->zero_grad();
+    auto buckets = GradBuckets::by_layer(*model);
+    std::vector<int> order;
+    buckets.on_ready = [&](int b) { order.push_back(b); };
+    l = loss(X, y, model, -1);
+    buckets.backward(l);
+    assert((order == std::vector<int>{0, 1, 2}));
+    std::vector<float> grads;
+    gather_grads(model->parameters(), grads);
+    for (int i = 0; i < grads.size(); ++i) {
+        assert(std::abs(grads[i] - expected[i]) <= 1e-4f * std::max(1.0f, std::abs(expected[i])));
+    }
 
-    std::vector<std::vector<std::shared_ptr<Value>>> inputs;
-    for (auto& xrow : X) {
-        std::vector<std::shared_ptr<Value>> row;
-        row.push_back(xrow);
-        inputs.push_back(row);
+    std::string prefix = "/tmp/value_bucket_" + std::to_string(getpid());
+    int world = 3;
+    bool ok = run_ranks(world, [&](int rank) {
+        Communicator comm(rank, world, Communicator::unix_addresses(prefix, world));
+        // every rank sees a different shard of the data
+        std::vector<std::shared_ptr<Value>> xs{X[rank]}, ys{y[rank]};
+
+        auto reference = std::make_shared<MLP>(1, std::vector<int>{6, 6, 1});
+        auto lr = loss(xs, ys, reference, -1);
+        lr->backward(lr);
+        comm.allreduce_grads(reference->parameters());
+
+        auto replica = std::make_shared<MLP>(1, std::vector<int>{6, 6, 1});
+        BucketedReducer reducer(comm, *replica);
+        for (int step = 0; step < 2; ++step) {
+            replica->zero_grad();
+            auto lb = loss(xs, ys, replica, -1);
+            reducer.backward(lb);
+        }
+        auto a = reference->parameters();
+        auto b = replica->parameters();
+        for (int i = 0; i < a.size(); ++i) {
+            assert(std::abs(a[i]->grad - b[i]->grad) <= 1e-4f * std::max(1.0f, std::abs(a[i]->grad)));
+        }
+    });
+    assert(ok);
+    std::cout << "Passed: test_bucketed_reduce" << std::endl;
+}
+void test_pipeline() {
+    auto model = MLP(2, {8, 8, 8, 1});
+    std::vector<std::vector<float>> X;
+    std::vector<float> y;
+    for (int i = 0; i < 10; ++i) {
+        X.push_back({0.1f * i, 0.5f - 0.05f * i});
+        y.push_back(i % 3 ? 1.0f : -1.0f);
     }
-    // print 
-    std::cout << "Inputs: " << std::endl;
-    for (auto& input : inputs) {
-        std::cout << input[0]->data << std::endl;
+
+    // reference: the whole batch as one graph on this thread
+    auto total = std::make_shared<Value>(0.0);
+    for (int i = 0; i < X.size(); ++i) {
+        auto score = model({std::make_shared<Value>(X[i][0]), std::make_shared<Value>(X[i][1])})[0];
+        total = Value::add(total, Value::add(std::make_shared<Value>(1.0), Value::multiply(std::make_shared<Value>(y[i]), score)));
     }
+    total = Value::multiply(total, std::make_shared<Value>(1.0f / X.size()));
+    total->backward(total);
+    std::vector<float> expected;
+    gather_grads(model.parameters(), expected);
 
-    // forward the model to get scores
-    std::vector<std::shared_ptr<Value>> scores;
-    for (auto& input : inputs) {
-        scores.push_back(model->operator()(input)[0]);
+    PipelineMLP pipe(model, 3);
+    assert(pipe.stages.size() == 3 && pipe.stages.front().first == 0 && pipe.stages.back().second == 4);
+    for (auto schedule : {PipelineMLP::GPipe, PipelineMLP::OneFOneB}) {
+        model.zero_grad();
+        pipe.schedule = schedule;
+        float l = pipe.train_step(X, y, 3);
+        assert(std::abs(l - total->data) <= 1e-4f * std::abs(total->data));
+        std::vector<float> grads;
+        gather_grads(model.parameters(), grads);
+        for (int i = 0; i < grads.size(); ++i) {
+            assert(std::abs(grads[i] - expected[i]) <= 1e-4f * std::max(1.0f, std::abs(expected[i])));
+        }
+        assert(pipe.last_bubble >= 0 && pipe.last_bubble <= 1);
     }
-    // print scores
-    std::cout << "Scores: " << std::endl;
-    for (auto& score : scores) {
-        std::cout << score->data << std::endl;
+    std::cout << "pipeline bubble " << pipe.last_bubble << " (ideal " << pipe.ideal_bubble(4) << ")" << std::endl;
+    std::cout << "Passed: test_pipeline" << std::endl;
+}
+void test_tensor_parallel() {
+    auto full = MLP(3, {10, 7, 1});
+    // distinct weights so that a misplaced shard would show up
+    auto params = full.parameters();
+    for (int i = 0; i < params.size(); ++i) {
+        params[i]->data = 0.01f * (i % 23) - 0.1f;
     }
+    std::vector<std::vector<float>> X{{0.5f, -1.0f, 2.0f}, {1.5f, 0.25f, -0.5f}, {0.0f, 1.0f, 1.0f}};
+    std::vector<float> y{1.0f, -1.0f, 1.0f};
 
-    // svm "max-margin" loss
-    std::vector<std::shared_ptr<Value>> losses;
-    for (int i = 0; i < y.size(); ++i) {
-        losses.push_back(Value::add(std::make_shared<Value>(1.0), Value::multiply(y[i], scores[i])));
+    auto total = std::make_shared<Value>(0.0);
+    for (int b = 0; b < X.size(); ++b) {
+        std::vector<std::shared_ptr<Value>> x;
+        for (auto v : X[b]) x.push_back(std::make_shared<Value>(v));
+        auto score = full(x)[0];
+        total = Value::add(total, Value::add(std::make_shared<Value>(1.0), Value::multiply(std::make_shared<Value>(y[b]), score)));
     }
-    std::shared_ptr<Value> data_loss = std::make_shared<Value>(0.0);
-    for (auto& lossi : losses) {
-        data_loss = Value::add(data_loss, lossi);
+    total = Value::multiply(total, std::make_shared<Value>(1.0f / X.size()));
+    total->backward(total);
+
+    std::string prefix = "/tmp/value_tp_" + std::to_string(getpid());
+    for (int world : {2, 3}) {
+        bool ok = run_ranks(world, [&](int rank) {
+            Communicator comm(rank, world, Communicator::unix_addresses(prefix, world));
+            ShardedMLP sharded(comm, full);
+            float l = sharded.train_step(X, y);
+            assert(std::abs(l - total->data) < 1e-5f);
+            // every local neuron must match its counterpart in the full model
+            for (int li = 0; li < full.layers.size(); ++li) {
+                auto& shard = *sharded.layers[li];
+                for (int j = 0; j < shard.local->neurons.size(); ++j) {
+                    auto& mine = shard.local->neurons[j];
+                    auto& ref = full.layers[li]->neurons[shard.bounds[rank] + j];
+                    for (int i = 0; i < mine->w.size(); ++i) {
+                        assert(std::abs(mine->w[i]->grad - ref->w[i]->grad) < 1e-5f);
+                    }
+                    assert(std::abs(mine->b->grad - ref->b->grad) < 1e-5f);
+                }
+            }
+        });
+        assert(ok);
     }
-    data_loss = Value::multiply(data_loss, std::make_shared<Value>(1.0 / losses.size()));
-    // L2 regularization
-    float alpha = 1e-4;
-    std::shared_ptr<Value> reg_loss = std::make_shared<Value>(0.0);
-    for (auto& p : model->parameters()) {
-        reg_loss = Value::add(reg_loss, Value::multiply(p, p));
+
+    // train_step's upstream gradient is one score per sample
+    Communicator solo(0, 1, Communicator::unix_addresses(prefix, 1));
+    bool threw = false;
+    try {
+        ShardedMLP wide(solo, 3, {4, 2});
+    } catch (const std::invalid_argument&) {
+        threw = true;
     }
-    reg_loss = Value::multiply(reg_loss, std::make_shared<Value>(alpha));
-    std::shared_ptr<Value> total_loss = Value::add(data_loss, reg_loss);
+    assert(threw);
+    std::cout << "Passed: test_tensor_parallel" << std::endl;
+}
+// mean squared error of a linear model on y = 2x + 1, built from add/multiply only
+std::shared_ptr<Value> mse(MLP& model, const std::vector<float>& xs) {
+    auto total = std::make_shared<Value>(0.0);
+    for (auto x : xs) {
+        auto d = Value::add(model({std::make_shared<Value>(x)})[0], std::make_shared<Value>(-(2 * x + 1)));
+        total = Value::add(total, Value::multiply(d, d));
+    }
+    return Value::multiply(total, std::make_shared<Value>(1.0f / xs.size()));
+}
 
-    // also get accuracy
-    std::vector<std::shared_ptr<Value>> accuracy;
-    for (int i = 0; i < y.size(); ++i) {
-        accuracy.push_back(Value::add(std::make_shared<Value>(y[i]->data > 0), std::make_shared<Value>(scores[i]->data > 0)));
+void test_param_server() {
+    std::string name = "/value_ps_" + std::to_string(getpid());
+    auto init = MLP(1, {1});
+    init.parameters()[0]->data = 0.1f;
+    std::vector<float> flat;
+    gather_data(init.parameters(), flat);
+    float initial = mse(init, {-1.0f, 0.0f, 1.0f, 2.0f})->data;
+
+    int workers = 3, steps = 40;
+    auto ps = ShmParamServer::create(name, flat.size(), workers, 4, 8);
+    ps->publish(flat);
+    bool ok = run_ranks(workers + 1, [&](int rank) {
+        if (rank == 0) {
+            // the server owns the optimizer; it only ever sees flat gradients
+            auto model = MLP(1, {1});
+            SGD opt(model.parameters(), 0.05f, 0.5f);
+            std::vector<float> params;
+            ps->pull(params);
+            scatter_data(params, model.parameters());
+            int seen = 0;
+            while (seen < workers * steps) {
+                int n = ps->serve([&](const float* grad, std::vector<float>& out) {
+                    for (int i = 0; i < out.size(); ++i) model.parameters()[i]->grad = grad[i];
+                    opt.step();
+                    gather_data(model.parameters(), out);
+                }, params);
+                if (n == 0) std::this_thread::yield();
+                seen += n;
+            }
+            return;
+        }
+        auto worker = ShmParamServer::attach(name);
+        auto model = MLP(1, {1});
+        std::vector<float> params, grads;
+        // each worker sees its own pair of samples
+        std::vector<float> xs{(float)rank - 2.0f, (float)rank - 1.5f};
+        for (int step = 0; step < steps; ++step) {
+            uint64_t version = worker->pull(params);
+            scatter_data(params, model.parameters());
+            model.zero_grad();
+            auto l = mse(model, xs);
+            l->backward(l);
+            gather_grads(model.parameters(), grads);
+            worker->push(rank - 1, grads, version);
+        }
+    });
+    assert(ok);
+
+    auto stats = ps->stats();
+    assert(stats.applied + stats.dropped == workers * steps && stats.applied > 0);
+    ps->pull(flat);
+    scatter_data(flat, init.parameters());
+    float final = mse(init, {-1.0f, 0.0f, 1.0f, 2.0f})->data;
+    assert(final < 0.25f * initial);
+    std::cout << "param server: applied " << stats.applied << ", dropped " << stats.dropped << ", loss " << initial << " -> " << final << std::endl;
+    std::cout << "Passed: test_param_server" << std::endl;
+}
+void test_compression() {
+    std::mt19937 rng(7);
+    std::normal_distribution<float> normal;
+    std::vector<std::unique_ptr<GradCompressor>> codecs;
+    codecs.push_back(std::make_unique<TopKCompressor>(0.1f));
+    codecs.push_back(std::make_unique<Int8Compressor>());
+    codecs.push_back(std::make_unique<SignCompressor>());
+    for (auto& codec : codecs) {
+        // error feedback: whatever is not sent now is sent later, so the running
+        // sums of what was sent and what was produced stay close
+        std::vector<float> produced(1000, 0), sent(1000, 0);
+        for (int step = 0; step < 50; ++step) {
+            std::vector<float> grad(1000);
+            for (auto& g : grad) g = normal(rng);
+            for (int i = 0; i < grad.size(); ++i) produced[i] += grad[i];
+            auto msg = codec->encode(grad);
+            assert(msg.size() < grad.size() * sizeof(float));
+            codec->decode_add(msg, sent);
+        }
+        float drift = 0, total = 0;
+        for (int i = 0; i < produced.size(); ++i) {
+            drift += std::abs(produced[i] - sent[i]);
+            total += std::abs(produced[i]);
+        }
+        assert(drift < 0.5f * total);
     }
-    std::shared_ptr<Value> acc = std::make_shared<Value>(0.0);
-    for (auto& acci : accuracy) {
-        acc = Value::add(acc, acci);
+
+    // one 8-bit message is within half a quantization step of its input
+    Int8Compressor int8;
+    std::vector<float> grad{0.5f, -1.0f, 0.25f, 0.0f}, out;
+    int8.decode_add(int8.encode(grad), out);
+    for (int i = 0; i < grad.size(); ++i) {
+        assert(std::abs(out[i] - grad[i]) <= 0.5f / 127 + 1e-6f);
     }
-    acc = Value::multiply(acc, std::make_shared<Value>(1.0 / accuracy.size()));
-    
-    return total_loss;
+
+    // an empty gradient encodes to a message with no entries; one naming an
+    // index past its length, or cut short, is refused
+    TopKCompressor topk(0.5f);
+    std::vector<float> none;
+    topk.decode_add(topk.encode(none), none);
+    assert(none.empty());
+    auto msg = topk.encode(grad);
+    std::vector<char> bad = msg;
+    uint32_t past = 4;
+    std::memcpy(bad.data() + 2 * sizeof(uint32_t), &past, sizeof(past));
+    for (auto& m : {bad, std::vector<char>(msg.begin(), msg.end() - 1)}) {
+        std::vector<float> into;
+        bool threw = false;
+        try {
+            topk.decode_add(m, into);
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        assert(threw);
+    }
+
+    std::string prefix = "/tmp/value_gc_" + std::to_string(getpid());
+    bool ok = run_ranks(3, [&](int rank) {
+        Communicator comm(rank, 3, Communicator::unix_addresses(prefix, 3));
+        auto model = MLP(2, {4, 1});
+        auto params = model.parameters();
+        for (int i = 0; i < params.size(); ++i) params[i]->grad = (float)(rank + 1) * (i % 5);
+        Int8Compressor codec;
+        comm.allreduce_grads(params, codec);
+        for (int i = 0; i < params.size(); ++i) {
+            assert(std::abs(params[i]->grad - 2.0f * (i % 5)) < 0.05f);
+        }
+        assert(comm.last.bytes < params.size() * sizeof(float) + 16);
+    });
+    assert(ok);
+    std::cout << "Passed: test_compression" << std::endl;
+}
+void test_local_sgd() {
+    std::string prefix = "/tmp/value_local_" + std::to_string(getpid());
+    int world = 3;
+    for (float outer_momentum : {0.0f, 0.5f}) {
+        bool ok = run_ranks(world, [&](int rank) {
+            Communicator comm(rank, world, Communicator::unix_addresses(prefix, world));
+            auto model = MLP(1, {1});
+            SGD opt(model.parameters(), 0.05f);
+            LocalSGD local(comm, model.parameters(), 4, outer_momentum);
+            std::vector<float> xs{(float)rank - 1.0f, (float)rank - 0.5f};
+            std::vector<float> all{-1.0f, -0.5f, 0.0f, 0.5f, 1.0f, 1.5f};
+            float before = mse(model, all)->data;
+            int synced = 0;
+            for (int step = 0; step < 40; ++step) {
+                opt.zero_grad();
+                auto l = mse(model, xs);
+                l->backward(l);
+                opt.step();
+                synced += local.step();
+            }
+            assert(synced == 10 && local.syncs == 10);
+            // right after a sync every replica holds the same parameters
+            std::vector<float> mine, sum;
+            gather_data(model.parameters(), mine);
+            sum = mine;
+            comm.allreduce(sum.data(), sum.size());
+            for (int i = 0; i < mine.size(); ++i) {
+                assert(std::abs(sum[i] - world * mine[i]) < 1e-5f);
+            }
+            assert(mse(model, all)->data < 0.1f * before);
+        });
+        assert(ok);
+    }
+    std::cout << "Passed: test_local_sgd" << std::endl;
 }
+void test_mapped_dataset() {
+    std::string path = "/tmp/value_ds_" + std::to_string(getpid()) + ".bin";
+    {
+        DatasetWriter writer(path, {"x", "y"}, 1000);
+        std::vector<float> rows;
+        for (int i = 0; i < 1000; ++i) {
+            rows.push_back(0.001f * i);
+            rows.push_back(i % 2 ? 1.0f : -1.0f);
+        }
+        writer.write_rows(0, rows.data(), 600);
+        writer.write_rows(600, rows.data() + 1200, 400);
+    }
 
-void test_loss() {
-    auto mlp = MLP(2, {16, 16, 1});
-    auto x = std::vector<std::shared_ptr<Value>>{std::make_shared<Value>(1.0), std::make_shared<Value>(2.0)};
-    auto y = std::vector<std::shared_ptr<Value>>{std::make_shared<Value>(1.0)};
-    auto l = loss(x, y, std::make_shared<MLP>(mlp), -1);
+    MappedDataset ds(path);
+    assert(ds.rows() == 1000 && ds.cols() == 2);
+    int x = ds.column_index("x"), y = ds.column_index("y");
+    assert(x == 0 && y == 1 && ds.column_index("z") == -1);
+    assert(reinterpret_cast<uintptr_t>(ds.column(x)) % 64 == 0 && reinterpret_cast<uintptr_t>(ds.column(y)) % 64 == 0);
+
+    // batches point straight into the mapping
+    auto b = ds.batch(990, 32);
+    assert(b.rows == 10 && b.col(x) == ds.column(x) + 990);
+    assert(b.col(x)[5] == 0.001f * 995 && b.col(y)[5] == 1.0f);
+
+    auto model = std::make_shared<MLP>(1, std::vector<int>{4, 1});
+    auto first = ds.batch(0, 4);
+    auto* out = std::cout.rdbuf(nullptr);
+    auto l = loss(MappedDataset::values(first, x), MappedDataset::values(first, y), model, 4);
+    std::cout.rdbuf(out);
     l->backward(l);
-    // print loss
-    std::cout << l->data << std::endl;
-    std::cout << "Passed: test_loss" << std::endl;
+
+    // a header promising more columns than the file holds is rejected
+    {
+        DatasetHeader header{};
+        std::memcpy(header.magic, "VALDSET", 8);
+        header.version = 1;
+        header.ncols = 1000;
+        header.nrows = 1;
+        std::ofstream f(path, std::ios::binary | std::ios::trunc);
+        f.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    }
+    bool threw = false;
+    try {
+        MappedDataset bad(path);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert(threw);
+    std::remove(path.c_str());
+    std::cout << "Passed: test_mapped_dataset" << std::endl;
+}
+void test_csv_ingest() {
+    std::string csv = "/tmp/value_csv_" + std::to_string(getpid()) + ".csv";
+    std::string bin = csv + ".bin";
+    std::vector<float> expected;
+    {
+        std::ofstream f(csv);
+        f << "x,y,label\r\n";
+        for (int i = 0; i < 5000; ++i) {
+            float x = 0.001f * i - 1.5f, y = 1e-3f * (i % 7), label = i % 2 ? 1.0f : -1.0f;
+            f << x << ", +" << y << "," << label << (i % 3 ? "\n" : "\r\n");
+            if (i == 100) f << "\n";     // blank lines are skipped
+            expected.insert(expected.end(), {x, y, label});
+        }
+    }
+
+    ThreadPool pool(3);
+    CsvReader reader(csv);
+    reader.chunk_bytes = 4096;  // many chunks, so boundaries get exercised
+    assert((reader.names == std::vector<std::string>{"x", "y", "label"}));
+    auto values = reader.read_all(pool);
+    assert(values.size() == expected.size() && reader.last.rows == 5000);
+    for (int i = 0; i < values.size(); ++i) {
+        // the stream printed 6 significant digits
+        assert(std::abs(values[i] - expected[i]) <= 1e-5f * std::max(1.0f, std::abs(expected[i])));
+    }
+
+    reader.to_dataset(bin, pool);
+    MappedDataset ds(bin);
+    assert(ds.rows() == 5000 && ds.names[2] == "label");
+    for (int i = 0; i < 5000; ++i) {
+        assert(ds.column(0)[i] == values[i * 3] && ds.column(2)[i] == values[i * 3 + 2]);
+    }
+
+    // tsv without a header, with an empty field
+    {
+        std::ofstream f(csv);
+        f << "1.5\t2\n\t-3e2\n";
+    }
+    CsvReader tsv(csv, '\t', false);
+    auto t = tsv.read_all(pool);
+    assert(tsv.cols() == 2 && t.size() == 4);
+    assert(t[0] == 1.5f && t[1] == 2.0f && std::isnan(t[2]) && t[3] == -300.0f);
+    std::remove(csv.c_str());
+    std::remove(bin.c_str());
+
+    // a directory opens but will not map; the fd must not outlive the throw
+    std::string dir = csv + ".d";
+    ::mkdir(dir.c_str(), 0700);
+    int before = ::dup(0);
+    ::close(before);
+    try {
+        CsvReader reader(dir);
+    } catch (const std::runtime_error&) {
+    }
+    int after = ::dup(0);
+    ::close(after);
+    assert(after == before);
+    ::rmdir(dir.c_str());
+    std::cout << "Passed: test_csv_ingest" << std::endl;
+}
+void test_data_pipeline() {
+    std::string path = "/tmp/value_dp_" + std::to_string(getpid()) + ".bin";
+    int n = 103;
+    {
+        DatasetWriter writer(path, {"a", "b", "id"}, n);
+        for (int i = 0; i < n; ++i) {
+            float row[3] = {2.0f * i + 5, (float)(i % 4), (float)i};
+            writer.write_rows(i, row, 1);
+        }
+    }
+    MappedDataset ds(path);
+    ThreadPool pool(2);
+    {
+        DataPipeline pipe(ds, {0, 1}, 2, 10, DataPipeline::Options(), pool);
+        assert(pipe.batches_per_epoch() == 11);
+        for (int epoch = 0; epoch < 2; ++epoch) {
+            // every row exactly once per epoch, in a shuffled order
+            std::vector<int> seen(n, 0);
+            double sum = 0;
+            bool in_order = true;
+            for (int k = 0; k < 11; ++k) {
+                auto b = pipe.next();
+                assert(b.rows == (k == 10 ? 3 : 10));
+                for (size_t r = 0; r < b.rows; ++r) {
+                    int id = (int)b.y[r];
+                    seen[id]++;
+                    in_order = in_order && id == k * 10 + (int)r;
+                    sum += b.x[r * 2];
+                    // normalized column a is an affine map of the id
+                    assert(std::abs(b.x[r * 2] * 59.4643 + 107.0 - (2.0 * id + 5)) < 1e-2);
+                }
+            }
+            for (int c : seen) assert(c == 1);
+            assert(!in_order && std::abs(sum) < 1e-3);
+        }
+        auto stats = pipe.stats();
+        assert(stats.batches == 22 && stats.stall_seconds >= 0 && stats.fill_seconds > 0);
+
+        auto b = pipe.next();
+        auto model = std::make_shared<MLP>(1, std::vector<int>{4, 1});
+        auto* out = std::cout.rdbuf(nullptr);
+        auto l = loss(b.feature_values(0), b.label_values(), model, (int)b.rows);
+        std::cout.rdbuf(out);
+        l->backward(l);
+    }
+
+    // raw features in file order
+    {
+        DataPipeline::Options opts;
+        opts.depth = 2;
+        opts.shuffle = false;
+        opts.normalize = false;
+        DataPipeline pipe(ds, {0, 1}, 2, 10, opts, pool);
+        for (int k = 0; k < 11; ++k) {
+            auto b = pipe.next();
+            for (size_t r = 0; r < b.rows; ++r) {
+                int id = k * 10 + (int)r;
+                assert(b.y[r] == id && b.x[r * 2] == 2.0f * id + 5 && b.x[r * 2 + 1] == (float)(id % 4));
+            }
+        }
+    }
+
+    // an empty dataset or a zero batch size would divide by zero in next()
+    std::string empty_path = path + ".empty";
+    {
+        DatasetWriter writer(empty_path, {"a", "id"}, 0);
+    }
+    MappedDataset empty(empty_path);
+    for (auto [source, batch] : {std::make_pair(&ds, (size_t)0), std::make_pair(&empty, (size_t)10)}) {
+        bool threw = false;
+        try {
+            DataPipeline pipe(*source, {0}, 1, batch, DataPipeline::Options(), pool);
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        assert(threw);
+    }
+    std::remove(empty_path.c_str());
+    std::remove(path.c_str());
+    std::cout << "Passed: test_data_pipeline" << std::endl;
+}
+
+// an .npy image as numpy writes it: v1.0 header padded to 64 bytes
+std::string npy_bytes(const std::string& descr, const std::string& shape, const void* data, size_t n) {
+    std::string header = "{'descr': '" + descr + "', 'fortran_order': False, 'shape': " + shape + ", }";
+    header.append(63 - (10 + header.size()) % 64, ' ');
+    header += '\n';
+    std::string out = "\x93NUMPY";
+    out += '\x01';
+    out += '\x00';
+    out += (char)(header.size() & 0xff);
+    out += (char)(header.size() >> 8);
+    return out + header + std::string(static_cast<const char*>(data), n);
+}
+
+void test_npy_load() {
+    std::string dir = "/tmp/value_npy_" + std::to_string(getpid());
+    float x[6] = {1.5f, -2, 3, 4, 5.25f, -6};
+    uint16_t h[4] = {0x3c00, 0xc000, 0x3555, 0x0001};     // 1, -2, ~1/3, smallest subnormal
+    int8_t q[3] = {-128, 0, 127};
+    float w[6] = {0.5f, -1, 2, 0, 1, -0.25f};
+    float b[2] = {0.1f, -0.2f};
+    std::string xs = npy_bytes("<f4", "(3, 2)", x, sizeof(x));
+    std::string hs = npy_bytes("<f2", "(2, 2)", h, sizeof(h));
+    std::string qs = npy_bytes("|i1", "(3,)", q, sizeof(q));
+    std::ofstream(dir + ".npy", std::ios::binary) << xs;
+
+    auto a = NpyArray::open(dir + ".npy");
+    assert(a.dtype() == NpyArray::F32 && a.rows() == 3 && a.cols() == 2);
+    auto batch = a.batch(1, 5);
+    assert(batch.rows == 2 && !batch.copied() && batch.at(1, 1) == -6);
+    auto col = NpyArray::values(batch, 0);
+    assert(col.size() == 2 && col[0]->data == 3 && col[1]->data == 5.25f);
+
+    // a stored zip holding three arrays, the second not 4-byte aligned
+    std::vector<std::pair<std::string, std::string>> members = {
+        {"h.npy", hs}, {"q.npy", qs}, {"x.npy", xs},
+        {"w.npy", npy_bytes("<f4", "(2, 3)", w, sizeof(w))}, {"b.npy", npy_bytes("<f4", "(2,)", b, sizeof(b))},
+    };
+    std::string zip, central;
+    auto le = [](std::string& s, uint64_t v, int n) { for (int i = 0; i < n; ++i) s += (char)(v >> (8 * i)); };
+    for (auto& m : members) {
+        size_t local = zip.size();
+        le(zip, 0x04034b50, 4); le(zip, 20, 2); le(zip, 0, 2); le(zip, 0, 2); le(zip, 0, 4); le(zip, 0, 4);
+        le(zip, m.second.size(), 4); le(zip, m.second.size(), 4); le(zip, m.first.size(), 2); le(zip, 0, 2);
+        zip += m.first + m.second;
+        le(central, 0x02014b50, 4); le(central, 20, 2); le(central, 20, 2); le(central, 0, 2); le(central, 0, 2);
+        le(central, 0, 4); le(central, 0, 4); le(central, m.second.size(), 4); le(central, m.second.size(), 4);
+        le(central, m.first.size(), 2); le(central, 0, 2); le(central, 0, 2); le(central, 0, 2); le(central, 0, 2);
+        le(central, 0, 4); le(central, local, 4);
+        central += m.first;
+    }
+    size_t dir_at = zip.size();
+    zip += central;
+    le(zip, 0x06054b50, 4); le(zip, 0, 4); le(zip, members.size(), 2); le(zip, members.size(), 2);
+    le(zip, central.size(), 4); le(zip, dir_at, 4); le(zip, 0, 2);
+    std::ofstream(dir + ".npz", std::ios::binary) << zip;
+
+    NpzFile npz(dir + ".npz");
+    assert(npz.names.size() == 5 && npz.contains("x") && !npz.contains("y"));
+    auto half = npz.array("h").batch(0, 2);
+    assert(half.copied() && half.at(0, 0) == 1 && half.at(0, 1) == -2);
+    assert(std::abs(half.at(1, 0) - 1.0f / 3) < 1e-3 && half.at(1, 1) == std::ldexp(1.0f, -24));
+    auto int8 = npz.array("q").batch(0, 3);
+    assert(int8.cols == 1 && int8.at(0, 0) == -128 && int8.at(2, 0) == 127);
+    auto inner = npz.array("x").batch(0, 3);
+    for (int i = 0; i < 6; ++i) assert(inner.data[i] == x[i]);
+
+    Layer layer(3, 2, false);
+    auto bias = npz.array("b");
+    npz.array("w").load_into(layer, &bias);
+    assert(layer.neurons[0]->w[2]->data == 2 && layer.neurons[1]->w[2]->data == -0.25f);
+    assert(layer.neurons[1]->b->data == -0.2f);
+    bool threw = false;
+    try {
+        npz.array("x").load_into(layer);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert(threw);
+
+    // lengths pointing past the end of the file are rejected, not followed
+    for (size_t field : {dir_at + 28, dir_at + 42}) {
+        std::string corrupt = zip;
+        corrupt[field] = corrupt[field + 1] = '\xff';
+        if (field == dir_at + 42) corrupt[field + 2] = corrupt[field + 3] = '\x7f';
+        std::ofstream(dir + ".npz", std::ios::binary | std::ios::trunc) << corrupt;
+        threw = false;
+        try {
+            NpzFile broken(dir + ".npz");
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        assert(threw);
+    }
+
+    // a shape with no closing paren, or one whose byte size wraps around
+    // 2^64 (2^62 x 4 floats), is rejected before any data is touched
+    for (std::string shape : {"(3, 2", "(4611686018427387904, 4)"}) {
+        std::ofstream(dir + ".npy", std::ios::binary | std::ios::trunc) << npy_bytes("<f4", shape, x, sizeof(x));
+        threw = false;
+        try {
+            NpyArray::open(dir + ".npy");
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        assert(threw);
+    }
+
+    std::remove((dir + ".npy").c_str());
+    std::remove((dir + ".npz").c_str());
+    std::cout << "Passed: test_npy_load" << std::endl;
+}
+
+void test_checkpoint() {
+    std::string path = "/tmp/value_ckpt_" + std::to_string(getpid()) + ".bin";
+    std::vector<float> xs{-1.0f, -0.5f, 0.5f, 1.0f};
+    MLP model(1, {3, 2, 1});
+    SGD opt(model.parameters(), 0.01f, 0.9f);
+    auto train = [&](MLP& m, SGD& o, int steps) {
+        for (int step = 0; step < steps; ++step) {
+            o.zero_grad();
+            auto l = mse(m, xs);
+            l->backward(l);
+            o.step();
+        }
+    };
+    train(model, opt, 5);
+    save_checkpoint(path, model, &opt, 5);
+
+    Checkpoint ckpt(path);
+    assert(ckpt.step() == 5 && ckpt.has_optimizer() && ckpt.momentum() == 0.9f);
+    assert(ckpt.layers.size() == 3 && ckpt.layers[1].nin == 3 && ckpt.layers[1].nout == 2);
+    assert(ckpt.nparams() == model.parameters().size());
+    assert(reinterpret_cast<uintptr_t>(ckpt.weights()) % 64 == 0 && reinterpret_cast<uintptr_t>(ckpt.velocity()) % 64 == 0);
+
+    auto restored = ckpt.model();
+    SGD ropt(restored->parameters(), 0);
+    ckpt.load_into(ropt);
+    std::vector<float> a, b;
+    gather_data(model.parameters(), a);
+    gather_data(restored->parameters(), b);
+    assert(a == b && ropt.velocity == opt.velocity && ropt.lr == opt.lr);
+
+    // resuming from the checkpoint continues the same trajectory
+    train(model, opt, 3);
+    train(*restored, ropt, 3);
+    gather_data(model.parameters(), a);
+    gather_data(restored->parameters(), b);
+    assert(a == b);
+
+    bool threw = false;
+    try {
+        MLP other(1, {2, 1});
+        ckpt.load_into(other);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert(threw);
+    // a layer table entry reaching past the parameter block
+    {
+        CheckpointState state;
+        state.capture(model, &opt, 5);
+        state.layers[2].first = state.weights.size() - 1;
+        state.write(path);
+    }
+    threw = false;
+    try {
+        Checkpoint bad(path);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert(threw);
+    ::truncate(path.c_str(), 100);
+    threw = false;
+    try {
+        Checkpoint truncated(path);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert(threw);
+    std::remove(path.c_str());
+    std::cout << "Passed: test_checkpoint" << std::endl;
+}
+
+void test_async_checkpoint() {
+    std::string path = "/tmp/value_ackpt_" + std::to_string(getpid()) + ".bin";
+    MLP model(2, {8, 8, 1});
+    SGD opt(model.parameters(), 0.01f, 0.5f);
+    std::vector<float> snapshot;
+    {
+        AsyncCheckpointer saver(model, &opt);
+        for (int step = 1; step <= 20; ++step) {
+            for (auto& p : model.parameters()) p->data += 1;
+            opt.velocity[0] = (float)step;
+            saver.save(path, step);
+            if (step == 20) gather_data(model.parameters(), snapshot);
+        }
+        // later updates must not leak into the snapshot being written
+        for (auto& p : model.parameters()) p->data = -1;
+        saver.wait();
+        auto stats = saver.stats();
+        assert(stats.saves == 20 && stats.written + stats.superseded == 20 && stats.written >= 1);
+
+        Checkpoint ckpt(path);
+        assert(ckpt.step() == 20 && ckpt.velocity()[0] == 20);
+        for (size_t i = 0; i < snapshot.size(); ++i) assert(ckpt.weights()[i] == snapshot[i]);
+        assert(::access((path + ".tmp").c_str(), F_OK) != 0);
+
+        // a failed write surfaces on the next call
+        saver.save("/nonexistent_dir/ckpt.bin", 21);
+        bool threw = false;
+        try {
+            saver.wait();
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        assert(threw);
+    }
+    std::remove(path.c_str());
+    std::cout << "Passed: test_async_checkpoint" << std::endl;
+}
+
+void test_inference_plan() {
+    std::string path = "/tmp/value_plan_" + std::to_string(getpid()) + ".bin";
+    MLP model(3, {5, 9, 2});
+    auto params = model.parameters();
+    for (size_t i = 0; i < params.size(); ++i) params[i]->data = std::sin(0.7f * i) * 0.5f;
+    InferencePlan::write(path, model);
+
+    InferencePlan plan(path);
+    assert(plan.nin() == 3 && plan.nout() == 2 && plan.nlayers() == 3);
+    std::vector<float> x;
+    for (int i = 0; i < 100 * 3; ++i) x.push_back(std::cos(0.3f * i));
+    ThreadPool pool(2);
+    auto y = plan.run(x);
+    auto yp = plan.run(x, &pool);
+    assert(y == yp);
+    for (int r = 0; r < 100; ++r) {
+        std::vector<std::shared_ptr<Value>> in;
+        for (int i = 0; i < 3; ++i) in.push_back(std::make_shared<Value>(x[r * 3 + i]));
+        auto out = model(in);
+        for (int o = 0; o < 2; ++o) assert(std::abs(out[o]->data - y[r * 2 + o]) < 1e-4f);
+    }
+
+    // layer tables that would send run() outside its buffers are refused
+    std::string image;
+    {
+        std::ifstream f(path, std::ios::binary);
+        image.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+    }
+    auto entry = [&](int l) { return reinterpret_cast<PlanLayer*>(&image[sizeof(PlanHeader) + l * sizeof(PlanLayer)]); };
+    std::vector<std::function<void()>> corruptions = {
+        [&]() { entry(1)->dst = 7; },
+        [&]() { entry(1)->src = 0; },
+        [&]() { entry(1)->stride = 2; },
+        [&]() { entry(2)->nin = 4; },
+        [&]() { entry(0)->nin = 2; },
+        [&]() { reinterpret_cast<PlanHeader*>(&image[0])->nout = 3; },
+    };
+    for (auto& corrupt : corruptions) {
+        std::string saved = image;
+        corrupt();
+        std::ofstream(path, std::ios::binary | std::ios::trunc) << image;
+        image = saved;
+        bool threw = false;
+        try {
+            InferencePlan bad(path);
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        assert(threw);
+    }
+    std::remove(path.c_str());
+    std::cout << "Passed: test_inference_plan" << std::endl;
+}
+
+void test_ssa_program() {
+    // x * x and x + x: one deduplicated child, two gradient contributions
+    auto x = std::make_shared<Value>(3.0f);
+    auto c = std::make_shared<Value>(2.0f);
+    auto f = Value::add(Value::multiply(x, x), Value::multiply(c, Value::add(x, x)));
+    auto g = SsaGraph::trace({f}, {x});
+    assert(g.ops.size() == 6 && g.ops[g.inputs[0]].kind == SsaOp::Input);
+    auto p = Program::compile(g);
+    std::vector<float> regs = p.init;
+    p.bind(regs.data(), {x});
+    p.forward(regs.data());
+    p.backward(regs.data());
+    assert(p.output(regs.data()) == 21 && p.grad(regs.data(), 0) == 10);
+
+    // the whole of loss() against Value::backward
+    auto model = std::make_shared<MLP>(1, std::vector<int>{6, 4, 1});
+    auto params = model->parameters();
+    for (size_t i = 0; i < params.size(); ++i) params[i]->data = std::sin(1.3f * i);
+    std::vector<std::shared_ptr<Value>> X, y;
+    for (int i = 0; i < 8; ++i) {
+        X.push_back(std::make_shared<Value>(0.25f * i - 1));
+        y.push_back(std::make_shared<Value>(i % 2 ? 1.0f : -1.0f));
+    }
+    auto* out = std::cout.rdbuf(nullptr);
+    auto l = loss(X, y, model, 8);
+    std::cout.rdbuf(out);
+    std::vector<std::shared_ptr<Value>> inputs = params;
+    inputs.insert(inputs.end(), X.begin(), X.end());
+    auto graph = SsaGraph::trace({l}, inputs);
+    auto prog = Program::compile(graph);
+    // the register file is much smaller than the graph
+    assert(prog.registers() < graph.ops.size() / 2);
+
+    l->backward(l);
+    regs = prog.init;
+    prog.bind(regs.data(), inputs);
+    prog.forward(regs.data());
+    prog.backward(regs.data());
+    assert(std::abs(prog.output(regs.data()) - l->data) < 1e-5f * std::max(1.0f, std::abs(l->data)));
+    for (int i = 0; i < params.size(); ++i) {
+        assert(std::abs(prog.grad(regs.data(), i) - params[i]->grad) < 1e-4f * std::max(1.0f, std::abs(params[i]->grad)));
+    }
+
+    // the same register file runs again with new inputs
+    for (auto& q : params) q->data *= 0.5f;
+    prog.bind(regs.data(), inputs);
+    prog.forward(regs.data());
+    std::cout.rdbuf(nullptr);
+    auto l2 = loss(X, y, model, 8);
+    std::cout.rdbuf(out);
+    assert(std::abs(prog.output(regs.data()) - l2->data) < 1e-5f * std::max(1.0f, std::abs(l2->data)));
+    std::cout << "Passed: test_ssa_program" << std::endl;
+}
+
+void test_ssa_passes() {
+    // (x * 1 + 2 * 3) + (0 + x) * (x * 1): folds, simplifies and merges down to
+    // x, 6, x + 6, x * x and the sum
+    auto x = std::make_shared<Value>(1.5f);
+    auto one = std::make_shared<Value>(1.0f);
+    auto lhs = Value::add(Value::multiply(x, one), Value::multiply(std::make_shared<Value>(2.0f), std::make_shared<Value>(3.0f)));
+    auto rhs = Value::multiply(Value::add(std::make_shared<Value>(0.0f), x), Value::multiply(x, std::make_shared<Value>(1.0f)));
+    auto f = Value::add(lhs, rhs);
+    auto g = SsaGraph::trace({f}, {x});
+    SsaPasses::Stats stats;
+    auto opt = SsaPasses::optimize(g, &stats);
+    assert(stats.before == g.ops.size() && stats.after == 5 && opt.ops.size() == 5);
+    assert(stats.folded == 1 && stats.simplified == 3);
+    for (auto* graph : {&g, &opt}) {
+        auto p = Program::compile(*graph);
+        auto regs = p.init;
+        p.bind(regs.data(), {x});
+        p.forward(regs.data());
+        p.backward(regs.data());
+        assert(p.output(regs.data()) == f->data && p.grad(regs.data(), 0) == 4);
+    }
+
+    // values no output needs go, inputs stay even when unused
+    auto unused = std::make_shared<Value>(7.0f);
+    auto side = Value::multiply(x, x);
+    auto both = SsaGraph::trace({f, side}, {x, unused});
+    both.outputs.resize(1);
+    size_t removed = 0;
+    auto pruned = SsaPasses::eliminate_dead(both, &removed);
+    assert(removed == 1 && pruned.inputs.size() == 2 && pruned.ops[pruned.inputs[1]].kind == SsaOp::Input);
+
+    // loss(): same value and gradients from a smaller graph
+    auto model = std::make_shared<MLP>(1, std::vector<int>{6, 4, 1});
+    auto params = model->parameters();
+    for (size_t i = 0; i < params.size(); ++i) params[i]->data = std::sin(1.3f * i);
+    std::vector<std::shared_ptr<Value>> X, y;
+    for (int i = 0; i < 8; ++i) {
+        X.push_back(std::make_shared<Value>(0.25f * i - 1));
+        y.push_back(std::make_shared<Value>(i % 2 ? 1.0f : -1.0f));
+    }
+    auto* out = std::cout.rdbuf(nullptr);
+    auto l = loss(X, y, model, 8);
+    std::cout.rdbuf(out);
+    std::vector<std::shared_ptr<Value>> inputs = params;
+    inputs.insert(inputs.end(), X.begin(), X.end());
+    auto graph = SsaGraph::trace({l}, inputs);
+    auto small = SsaPasses::optimize(graph, &stats);
+    assert(stats.after < graph.ops.size() && stats.simplified > 0 && stats.merged >= 7);
+    auto p0 = Program::compile(graph), p1 = Program::compile(small);
+    assert(p1.forward_code.size() + p1.backward_code.size() < p0.forward_code.size() + p0.backward_code.size());
+    auto r0 = p0.init, r1 = p1.init;
+    p0.bind(r0.data(), inputs);
+    p1.bind(r1.data(), inputs);
+    p0.forward(r0.data());
+    p0.backward(r0.data());
+    p1.forward(r1.data());
+    p1.backward(r1.data());
+    assert(std::abs(p0.output(r0.data()) - p1.output(r1.data())) < 1e-5f);
+    for (int i = 0; i < inputs.size(); ++i) {
+        assert(std::abs(p0.grad(r0.data(), i) - p1.grad(r1.data(), i)) < 1e-5f);
+    }
+    std::cout << "Passed: test_ssa_passes" << std::endl;
+}
+
+void test_expression_templates() {
+    auto b = std::make_shared<Value>(0.5f);
+    auto w0 = std::make_shared<Value>(2.0f);
+    auto x0 = std::make_shared<Value>(-3.0f);
+    auto w1 = std::make_shared<Value>(4.0f);
+    auto x1 = std::make_shared<Value>(1.5f);
+
+    // one fused node over five leaves
+    std::shared_ptr<Value> fused = b + w0 * x0 + w1 * x1 + 2.0f * (w0 * w0);
+    assert(fused->_op == "fused" && fused->_prev.size() == 5 && fused->data == 8.5f);
+    fused->backward(fused);
+    std::vector<float> got;
+    for (auto& v : {b, w0, x0, w1, x1}) {
+        got.push_back(v->grad);
+        v->grad = 0;
+    }
+
+    auto eager = Value::add(Value::add(Value::add(b, Value::multiply(w0, x0)), Value::multiply(w1, x1)),
+                            Value::multiply(std::make_shared<Value>(2.0f), Value::multiply(w0, w0)));
+    eager->backward(eager);
+    std::vector<float> want{b->grad, w0->grad, x0->grad, w1->grad, x1->grad};
+    assert(eager->data == fused->data && got == want);
+
+    // fused nodes compose with each other and with the eager ops
+    std::shared_ptr<Value> h = fused * fused + 1.0f;
+    auto k = Value::multiply(h, x1);
+    assert(k->data == (8.5f * 8.5f + 1) * 1.5f);
+    std::cout << "Passed: test_expression_templates" << std::endl;
+}
+
+void test_static_mlp() {
+    static_assert(StaticMLP<2, 16, 16, 1>::num_params == 2*16 + 16*16 + 16*1 + 16 + 16 + 1, "same count as MLP");
+    auto mlp = MLP(2, {16, 16, 1});
+    auto params = mlp.parameters();
+    for (size_t i = 0; i < params.size(); ++i) params[i]->data = 0.3f * std::sin(0.37f * i);
+    StaticMLP<2, 16, 16, 1> net;
+    net.load(mlp);
+
+    auto x = std::vector<std::shared_ptr<Value>>{std::make_shared<Value>(0.7f), std::make_shared<Value>(-1.2f)};
+    auto y = mlp(x);
+    y[0]->backward(y[0]);
+    auto out = net.forward({0.7f, -1.2f});
+    assert(std::abs(out[0] - y[0]->data) < 1e-5f);
+    net.zero_grad();
+    auto dx = net.backward({1.0f});
+    auto g = net.grads();
+    assert(g.size() == params.size());
+    for (size_t i = 0; i < g.size(); ++i) assert(std::abs(g[i] - params[i]->grad) < 1e-5f);
+    assert(std::abs(dx[0] - x[0]->grad) < 1e-5f && std::abs(dx[1] - x[1]->grad) < 1e-5f);
+
+    bool threw = false;
+    try {
+        StaticMLP<2, 3, 1> other;
+        other.load(mlp);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert(threw);
+    std::cout << "Passed: test_static_mlp" << std::endl;
+}
+
+void test_compiled_program() {
+    std::string dir = "/tmp/value_jit_" + std::to_string(getpid());
+    auto model = std::make_shared<MLP>(1, std::vector<int>{4, 1});
+    auto params = model->parameters();
+    for (size_t i = 0; i < params.size(); ++i) params[i]->data = std::cos(0.9f * i);
+    std::vector<std::shared_ptr<Value>> X, y;
+    for (int i = 0; i < 4; ++i) {
+        X.push_back(std::make_shared<Value>(0.5f * i - 1));
+        y.push_back(std::make_shared<Value>(i % 2 ? 1.0f : -1.0f));
+    }
+    auto* out = std::cout.rdbuf(nullptr);
+    auto l = loss(X, y, model, 4);
+    std::cout.rdbuf(out);
+    std::vector<std::shared_ptr<Value>> inputs = params;
+    inputs.insert(inputs.end(), X.begin(), X.end());
+    auto prog = Program::compile(SsaGraph::trace({l}, inputs));
+
+    std::string library;
+    for (bool expect_cached : {false, true}) {
+        CompiledProgram compiled(prog, dir);
+        assert(compiled.cached == expect_cached);
+        library = compiled.library;
+        auto a = prog.init, b = prog.init;
+        prog.bind(a.data(), inputs);
+        prog.bind(b.data(), inputs);
+        prog.forward(a.data());
+        prog.backward(a.data());
+        compiled.forward(b.data());
+        compiled.backward(b.data());
+        assert(std::abs(prog.output(a.data()) - prog.output(b.data())) < 1e-6f);
+        for (int i = 0; i < params.size(); ++i) {
+            assert(std::abs(prog.grad(a.data(), i) - prog.grad(b.data(), i)) < 1e-6f);
+        }
+    }
+
+    // a library whose stored source differs, as after a hash collision, is
+    // rebuilt rather than loaded
+    std::string stored = library.substr(0, library.size() - 3) + ".cpp";
+    {
+        std::fstream f(stored, std::ios::in | std::ios::out | std::ios::binary);
+        f.seekp(-2, std::ios::end);
+        f << "//";
+    }
+    {
+        CompiledProgram compiled(prog, dir);
+        assert(!compiled.cached);
+    }
+    assert(CompiledProgram(prog, dir).cached);
+
+    // a cache others can write to is refused before anything is loaded
+    ::chmod(dir.c_str(), 0777);
+    bool threw = false;
+    try {
+        CompiledProgram compiled(prog, dir);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert(threw);
+    ::chmod(dir.c_str(), 0700);
+    std::remove(library.c_str());
+    std::remove(stored.c_str());
+    ::rmdir(dir.c_str());
+    std::cout << "Passed: test_compiled_program" << std::endl;
+}
+
+void test_inference_engine() {
+    std::string path = "/tmp/value_engine_" + std::to_string(getpid());
+    MLP model(3, {8, 2});
+    auto params = model.parameters();
+    for (size_t i = 0; i < params.size(); ++i) params[i]->data = std::cos(0.41f * i);
+    InferencePlan::write(path + ".plan", model);
+    InferencePlan plan(path + ".plan");
+    // a second plan for the reference outputs; a plan's workspace is not shared
+    InferencePlan reference(path + ".plan");
+    std::mutex reference_m;
+    auto expect = [&](const std::vector<float>& x) {
+        std::lock_guard<std::mutex> lock(reference_m);
+        return reference.run(x);
+    };
+
+    BatchingOptions opts;
+    opts.max_batch = 8;
+    opts.max_delay = std::chrono::milliseconds(2);
+    {
+        InferenceEngine engine(plan, opts);
+        std::vector<std::thread> clients;
+        std::atomic<int> wrong{0};
+        for (int t = 0; t < 4; ++t) {
+            clients.emplace_back([&, t]() {
+                std::vector<std::vector<float>> xs;
+                std::vector<std::future<std::vector<float>>> ys;
+                for (int i = 0; i < 50; ++i) {
+                    xs.push_back({0.1f * t, 0.01f * i, -1.0f});
+                    ys.push_back(engine.submit(xs.back()));
+                }
+                for (int i = 0; i < 50; ++i) {
+                    if (ys[i].get() != expect(xs[i])) wrong++;
+                }
+            });
+        }
+        for (auto& c : clients) c.join();
+        assert(wrong == 0);
+        auto stats = engine.stats();
+        assert(stats.requests == 200 && stats.latency.count == 200);
+        // requests were coalesced, never past max_batch
+        assert(stats.batches < 200 && stats.batch_size.max <= 8 && stats.batch_size.mean() > 1);
+        assert(stats.latency.percentile(0.5) <= stats.latency.percentile(0.99) && stats.throughput > 0);
+
+        InferenceServer server(engine, path + ".sock");
+        std::vector<std::thread> remote;
+        for (int t = 0; t < 3; ++t) {
+            remote.emplace_back([&, t]() {
+                for (int i = 0; i < 10; ++i) {
+                    std::vector<float> x{1.0f * t, 0.5f * i, 2.0f};
+                    if (InferenceServer::query(path + ".sock", x) != expect(x)) wrong++;
+                }
+            });
+        }
+        for (auto& r : remote) r.join();
+        assert(wrong == 0 && engine.stats().requests == 230);
+
+        // a client stuck halfway through a request holds up no one else
+        int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        std::strncpy(addr.sun_path, (path + ".sock").c_str(), sizeof(addr.sun_path) - 1);
+        assert(fd >= 0 && ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+        std::vector<float> x{0.5f, 0.25f, -2.0f};
+        char msg[sizeof(uint32_t) + 3 * sizeof(float)];
+        uint32_t n = 3;
+        std::memcpy(msg, &n, sizeof(n));
+        std::memcpy(msg + sizeof(n), x.data(), 3 * sizeof(float));
+        assert(::send(fd, msg, 6, 0) == 6);
+        assert(InferenceServer::query(path + ".sock", {1.0f, 2.0f, 3.0f}) == expect({1.0f, 2.0f, 3.0f}));
+        assert(::send(fd, msg + 6, sizeof(msg) - 6, 0) == (ssize_t)sizeof(msg) - 6);
+        char reply[sizeof(uint32_t) + 2 * sizeof(float)];
+        assert(::recv(fd, reply, sizeof(reply), MSG_WAITALL) == (ssize_t)sizeof(reply));
+        std::vector<float> y(2);
+        std::memcpy(&n, reply, sizeof(n));
+        std::memcpy(y.data(), reply + sizeof(n), 2 * sizeof(float));
+        assert(n == 2 && y == expect(x));
+        ::close(fd);
+
+        // nor does one that pipelines requests and never reads the replies:
+        // they overflow its socket buffer and queue on the server instead
+        fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        assert(fd >= 0 && ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+        std::vector<char> flood;
+        for (int i = 0; i < 40000; ++i) flood.insert(flood.end(), msg, msg + sizeof(msg));
+        uint64_t before = engine.stats().requests;
+        for (size_t at = 0; at < flood.size();) {
+            ssize_t k = ::send(fd, flood.data() + at, flood.size() - at, 0);
+            assert(k > 0);
+            at += k;
+        }
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        while (engine.stats().requests < before + 40000 && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        assert(engine.stats().requests == before + 40000);
+        assert(InferenceServer::query(path + ".sock", {1.0f, 2.0f, 3.0f}) == expect({1.0f, 2.0f, 3.0f}));
+        ::close(fd);
+
+        // a request of the wrong width gets an empty reply
+        bool threw = false;
+        try {
+            InferenceServer::query(path + ".sock", {1.0f, 2.0f});
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        assert(threw);
+    }
+
+    // a model that throws fails its whole batch, and the engine carries on
+    {
+        InferenceEngine engine([](const float* x, size_t rows, float* y) {
+            for (size_t i = 0; i < rows; ++i) {
+                if (x[i] < 0) throw std::runtime_error("negative input");
+                y[i] = 2 * x[i];
+            }
+        }, 1, 1, opts);
+        auto bad = engine.submit({-1.0f});
+        bool threw = false;
+        try {
+            bad.get();
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        assert(threw);
+        std::atomic<int> calls{0};
+        engine.submit({3.0f}, [&](std::vector<float>, std::exception_ptr) {
+            calls++;
+            throw std::logic_error("callback");
+        });
+        assert(engine.submit({4.0f}).get() == std::vector<float>{8.0f});
+        auto stats = engine.stats();
+        assert(calls == 1 && stats.failed == 1 && stats.requests == 3);
+    }
+    std::remove((path + ".plan").c_str());
+    std::cout << "Passed: test_inference_engine" << std::endl;
 }
 
+// csv ingestion throughput on a generated file
+void bench_csv() {
+    std::string csv = "/tmp/value_bench_csv_" + std::to_string(getpid()) + ".csv";
+    {
+        std::ofstream f(csv);
+        std::mt19937 rng(1);
+        std::uniform_real_distribution<float> u(-100, 100);
+        f << "a,b,c,d,e,f,g,h\n";
+        for (int i = 0; i < 1000000; ++i) {
+            for (int c = 0; c < 8; ++c) f << u(rng) << (c == 7 ? '\n' : ',');
+        }
+    }
+    CsvReader reader(csv);
+    reader.read_all();
+    std::cout << "csv ingest: " << reader.last.bytes / 1e6 << " MB, " << reader.last.rows << " rows in " << reader.last.seconds << " s, " << reader.last.gbps << " GB/s" << std::endl;
+    std::remove(csv.c_str());
+}
+
+// per-call inference latency of the test_num_params network, dynamic MLP
+// against StaticMLP
+void bench_static_mlp() {
+    auto mlp = MLP(2, {16, 16, 1});
+    StaticMLP<2, 16, 16, 1> net;
+    net.load(mlp);
+    int n = 1000000;
+    float sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; ++i) {
+        sink += net.forward({0.001f * (i & 1023), 1.0f})[0];
+    }
+    double static_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / n;
+    int m = 2000;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < m; ++i) {
+        auto x = std::vector<std::shared_ptr<Value>>{std::make_shared<Value>(0.001f * i), std::make_shared<Value>(1.0f)};
+        sink += mlp(x)[0]->data;
+    }
+    double dynamic_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / m;
+    std::cout << "MLP(2,{16,16,1}) forward: StaticMLP " << static_ns << " ns, MLP " << dynamic_ns << " ns (" << (sink != 0) << ")" << std::endl;
+}
+
+// data-parallel training on the loss() task over 2 local ranks, once per
+// gradient encoding; reports bytes sent per rank per step and the final loss
+void bench_compression() {
+    std::string prefix = "/tmp/value_bench_gc_" + std::to_string(getpid());
+    int world = 2, steps = 30;
+    for (std::string codec_name : {"none", "TopK", "Int8", "Sign"}) {
+        run_ranks(world, [&](int rank) {
+            Communicator comm(rank, world, Communicator::unix_addresses(prefix, world));
+            std::unique_ptr<GradCompressor> codec;
+            if (codec_name == "TopK") codec = std::make_unique<TopKCompressor>(0.01f);
+            if (codec_name == "Int8") codec = std::make_unique<Int8Compressor>();
+            if (codec_name == "Sign") codec = std::make_unique<SignCompressor>();
+            auto model = std::make_shared<MLP>(2, std::vector<int>{32, 32, 1});
+            SGD opt(model->parameters(), 1e-5f);
+            std::vector<std::shared_ptr<Value>> X, y;
+            for (int i = 0; i < 8; ++i) {
+                float x = 0.25f * i - 1.0f + 0.1f * rank;
+                X.push_back(std::make_shared<Value>(x));
+                y.push_back(std::make_shared<Value>(x > 0 ? 1.0f : -1.0f));
+            }
+            // loss() logs its inputs and scores; keep the table readable
+            auto* out = std::cout.rdbuf(nullptr);
+            float first = 0, last = 0;
+            for (int step = 0; step < steps; ++step) {
+                opt.zero_grad();
+                auto l = loss(X, y, model, -1);
+                l->backward(l);
+                if (codec) {
+                    comm.allreduce_grads(model->parameters(), *codec);
+                } else {
+                    comm.allreduce_grads(model->parameters());
+                }
+                opt.step();
+                if (step == 0) first = l->data;
+            }
+            last = loss(X, y, model, -1)->data;
+            std::cout.rdbuf(out);
+            if (rank == 0) {
+                std::cout << codec_name << ": " << comm.bytes_sent / steps << " bytes/step on the wire, loss " << first << " -> " << last << std::endl;
+            }
+        });
+    }
+}
 
 // main func
-int main() {
+int main(int argc, char** argv) {
     test_grad();
     test_num_params();
     test_mlp();
     test_loss();
+    test_backward_parallel();
+    test_forward_parallel();
+    test_thread_pool();
+    test_tapes_deterministic();
+    test_grad_accumulation();
+    test_ring_allreduce();
+    test_bucketed_reduce();
+    test_pipeline();
+    test_tensor_parallel();
+    test_param_server();
+    test_compression();
+    test_local_sgd();
+    test_mapped_dataset();
+    test_csv_ingest();
+    test_data_pipeline();
+    test_npy_load();
+    test_checkpoint();
+    test_async_checkpoint();
+    test_inference_plan();
+    test_ssa_program();
+    test_ssa_passes();
+    test_compiled_program();
+    test_expression_templates();
+    test_static_mlp();
+    test_inference_engine();
+    if (argc > 1 && std::string(argv[1]) == "--bench") {
+        bench_compression();
+        bench_csv();
+        bench_static_mlp();
+    }
     return 0;
 }
\ No newline at end of file